@@ -122,6 +122,17 @@
  */
 #define MAX_HEAP_SIZE (1ull*(1ull<<40)) /* 1 TB */
 
+/*
+ * Number of equal arena regions the heap is split into
+ */
+#define MAX_ARENAS 16
+
+/*
+ * Number of memlib regions that can exist at once: the MAX_ARENAS of
+ * the heap plus the ones made through mem_region_create
+ */
+#define MAX_REGIONS 64
+
 
 /***************** Parameters for looking up reference throughput *********/
 /*
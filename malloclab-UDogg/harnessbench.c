@@ -0,0 +1,256 @@
+/*
+ * harnessbench - times what mdriver's replay loop costs apart from the
+ * allocator, with the ops in the packed 8-byte records of tracefmt.h
+ * and in the 24-byte records they replaced.
+ *
+ * Usage: harnessbench [-h] [-f <file.rep>] [-n <ops>]
+ *
+ * The trace is tiled until it is <ops> long, so that the ops stream
+ * from memory as they do on a long trace rather than sitting in cache,
+ * and replayed into a stub allocator that hands back one pointer: what
+ * is left is the harness.  Each layout is then replayed once more, as
+ * the trace itself, into mm, as eval_mm_speed does.  Times are the best
+ * of fsec's samples.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "fcyc.h"
+#include "tracefmt.h"
+
+#define MAXLINE   1024                   /* max string size */
+#define TILED_OPS (4 * 1024 * 1024)      /* Default length of the tiled trace */
+
+/* An op as traceop_t held it before version 2 of tracefmt.h */
+typedef struct {
+    int type;
+    long index;
+    size_t size;
+} wideop_t;
+
+/* The allocator a replay calls, through pointers as in any harness */
+typedef struct {
+    void *(*malloc)(size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    void (*start)(void);
+} allocator_t;
+
+/* What one timed replay does */
+typedef struct {
+    const allocator_t *alloc;
+    const wideop_t *wide;
+    const traceop_t *ops;
+    const uint64_t *huge;
+    int num_ops;
+    char **blocks;
+} replay_t;
+
+static char stub_block[16];
+
+static void *stub_malloc(size_t size) { return stub_block; }
+static void *stub_realloc(void *ptr, size_t size) { return stub_block; }
+static void stub_free(void *ptr) { }
+static void stub_start(void) { }
+
+static void mm_start(void) {
+    mem_reset_brk();
+    if (!mm_init()) {
+        fprintf(stderr, "harnessbench: mm_init failed\n");
+        exit(1);
+    }
+}
+
+static const allocator_t stub = { stub_malloc, stub_realloc, stub_free, stub_start };
+static const allocator_t mm = { mm_malloc, mm_realloc, mm_free, mm_start };
+
+static void die(const char *file, const char *msg) {
+    fprintf(stderr, "harnessbench: %s: %s\n", file, msg);
+    exit(1);
+}
+
+/*
+ * replay_wide - eval_mm_speed's loop over the 24-byte ops
+ */
+static void replay_wide(void *ptr) {
+    replay_t *r = ptr;
+    const wideop_t *op, *end;
+
+    r->alloc->start();
+    for (op = r->wide, end = op + r->num_ops; op < end; op++) {
+        switch (op->type) {
+            case ALLOC:
+                r->blocks[op->index] = r->alloc->malloc(op->size);
+                break;
+            case REALLOC:
+                r->blocks[op->index] = r->alloc->realloc(r->blocks[op->index], op->size);
+                break;
+            default:
+                r->alloc->free(op->index < 0 ? NULL : r->blocks[op->index]);
+                break;
+        }
+    }
+}
+
+/*
+ * replay_packed - the same loop over the packed ops
+ */
+static void replay_packed(void *ptr) {
+    replay_t *r = ptr;
+    const traceop_t *op, *end;
+    int32_t index;
+
+    r->alloc->start();
+    for (op = r->ops, end = op + r->num_ops; op < end; op++) {
+        index = trace_op_index(*op);
+        switch (trace_op_type(*op)) {
+            case ALLOC:
+                r->blocks[index] = r->alloc->malloc(trace_op_size(*op, r->huge));
+                break;
+            case REALLOC:
+                r->blocks[index] = r->alloc->realloc(r->blocks[index],
+                                                     trace_op_size(*op, r->huge));
+                break;
+            default:
+                r->alloc->free(index < 0 ? NULL : r->blocks[index]);
+                break;
+        }
+    }
+}
+
+/*
+ * read_rep - read the requests of a .rep file into both layouts, with
+ *            room for tiling them out to max_ops
+ */
+static int read_rep(const char *name, replay_t *r, long max_ops, long *num_ids) {
+    char type[MAXLINE];
+    FILE *in;
+    long weight, num_ops, index, i, num_huge = 0;
+    unsigned long long data_bytes, size;
+    wideop_t *wide;
+    traceop_t *ops;
+    uint64_t *huge;
+
+    if ((in = fopen(name, "r")) == NULL)
+        die(name, "cannot open");
+    if (fscanf(in, "%ld %ld %ld %llu", &weight, num_ids, &num_ops, &data_bytes) != 4)
+        die(name, "bad header");
+    if (*num_ids < 1 || *num_ids > (long) TRACE_MAX_IDS || num_ops < 1 || num_ops > INT_MAX)
+        die(name, "bad id or op count");
+    if (max_ops < num_ops)
+        max_ops = num_ops;
+    if ((wide = malloc(max_ops * sizeof(*wide))) == NULL ||
+        (ops = malloc(max_ops * sizeof(*ops))) == NULL ||
+        (huge = malloc(num_ops * sizeof(*huge))) == NULL)
+        die(name, "out of memory");
+
+    for (i = 0; i < num_ops; i++) {
+        if (fscanf(in, "%s", type) != 1)
+            die(name, "fewer requests than the header promises");
+        size = 0;
+        switch (type[0]) {
+            case 'a':
+            case 'r':
+                if (fscanf(in, "%ld %llu", &index, &size) != 2 ||
+                    index < 0 || index >= *num_ids)
+                    die(name, "bad request");
+                wide[i].type = type[0] == 'a' ? ALLOC : REALLOC;
+                break;
+            case 'f':
+                if (fscanf(in, "%ld", &index) != 1 || index < -1 || index >= *num_ids)
+                    die(name, "bad request");
+                wide[i].type = FREE;
+                break;
+            default:
+                die(name, "bogus request type");
+        }
+        wide[i].index = index;
+        wide[i].size = size;
+        if (size >= TRACE_HUGE)
+            huge[num_huge] = size;
+        ops[i] = trace_op(wide[i].type, index,
+                          size < TRACE_HUGE ? (uint32_t) size : TRACE_HUGE + num_huge++);
+    }
+    fclose(in);
+
+    r->wide = wide;
+    r->ops = ops;
+    r->huge = huge;
+    return (int) num_ops;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-h] [-f <file.rep>] [-n <ops>]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace (default traces/syn-mix.rep).\n");
+    fprintf(stderr, "\t-n <ops>   Tile the trace out to <ops> for the stub runs.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+int main(int argc, char **argv) {
+    const char *name = "traces/syn-mix.rep";
+    long tiled = TILED_OPS, num_ids, i;
+    int num_ops, c;
+    double wide_stub, packed_stub, wide_mm, packed_mm;
+    replay_t r;
+    wideop_t *wide;
+    traceop_t *ops;
+
+    while ((c = getopt(argc, argv, "f:n:h")) != EOF) {
+        switch (c) {
+            case 'f':
+                name = optarg;
+                break;
+            case 'n':
+                tiled = strtol(optarg, NULL, 0);
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (tiled < 1 || tiled > INT_MAX)
+        die(name, "bad op count");
+
+    num_ops = read_rep(name, &r, tiled, &num_ids);
+    if ((r.blocks = calloc(num_ids, sizeof(*r.blocks))) == NULL)
+        die(name, "out of memory");
+    mem_init();
+
+    /* The real trace into mm, starting each run from an empty heap */
+    r.num_ops = num_ops;
+    r.alloc = &mm;
+    replay_packed(&r);
+    wide_mm = fsec(replay_wide, &r) / num_ops;
+    packed_mm = fsec(replay_packed, &r) / num_ops;
+
+    /* The tiled trace into the stub */
+    wide = (wideop_t *) r.wide;
+    ops = (traceop_t *) r.ops;
+    for (i = num_ops; i < tiled; i++) {
+        wide[i] = wide[i % num_ops];
+        ops[i] = ops[i % num_ops];
+    }
+    r.num_ops = tiled > num_ops ? (int) tiled : num_ops;
+    r.alloc = &stub;
+    wide_stub = fsec(replay_wide, &r) / r.num_ops;
+    packed_stub = fsec(replay_packed, &r) / r.num_ops;
+
+    printf("%s: %d ops, tiled to %d for the stub\n\n", name, num_ops, r.num_ops);
+    printf("%-10s%12s%14s%14s%14s\n", "layout", "bytes/op", "op data MB",
+           "stub ns/op", "mm ns/op");
+    printf("%-10s%12zu%14.1f%14.2f%14.2f\n", "24-byte", sizeof(wideop_t),
+           r.num_ops * sizeof(wideop_t) / 1e6, wide_stub * 1e9, wide_mm * 1e9);
+    printf("%-10s%12zu%14.1f%14.2f%14.2f\n", "packed", sizeof(traceop_t),
+           r.num_ops * sizeof(traceop_t) / 1e6, packed_stub * 1e9, packed_mm * 1e9);
+    mem_deinit();
+    return 0;
+}
@@ -7,9 +7,11 @@
  * Copyright (c) 2004-2016, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -20,12 +22,19 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fcyc.h"
 #include "config.h"
 #include "stree.h"
+#include "tracefmt.h"
 
 /**********************
  * Constants and macros
@@ -35,6 +44,11 @@
 #define MAXLINE     1024          /* max string size */
 #define HDRLINES       4          /* number of header lines in a trace file */
 #define LINENUM(i) (i+HDRLINES+1) /* cnvt trace request nums to linenums (origin 1) */
+#define MT_REPS        3          /* runs per thread count in eval_mm_threads, best counts */
+#define STREAM_CHUNK   65536      /* ops decoded at a time by the -S prefetch thread */
+#define STREAM_REPORT  (1 << 24)  /* ops between -S progress lines at -V */
+#define TEST_CHECK     0x1        /* run_tests: check correctness and utilization */
+#define TEST_TIME      0x2        /* run_tests: time the trace */
 
 #ifndef REF_ONLY
 #define REF_ONLY 0
@@ -78,13 +92,6 @@ typedef struct {
     tree_t *lo_tree;
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    long index;                         /* index for free() to use later */
-    size_t size;                        /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file */
 typedef struct {
     char filename[MAXLINE];
@@ -93,11 +100,21 @@ typedef struct {
     int num_ops;          /* number of distinct requests */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
+    uint64_t *huge;       /* sizes too big for an op's size field */
+    int num_huge;         /* number of huge sizes */
+    void *map;            /* mapping of a binary trace that ops points into, or NULL */
+    size_t map_len;       /* bytes mapped */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     int *block_rand_base; /* index into random_data, if debug is on */
 } trace_t;
 
+/* op_size - the size of request i of trace */
+static inline size_t op_size(const trace_t *trace, int i)
+{
+    return trace_op_size(trace->ops[i], trace->huge);
+}
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -107,6 +124,50 @@ typedef struct {
     trace_t *trace;
 } speed_t;
 
+/* Holds the params to one thread of eval_mm_threads */
+typedef struct {
+    trace_t *trace;
+    char **blocks;        /* the thread's own copy of trace->blocks */
+    int first;            /* eval_mm_remote: free blocks first, */
+    int stride;           /* first + stride, ... below num_blocks */
+    int num_blocks;
+    pthread_barrier_t *barrier; /* eval_mm_remote: starts the frees together */
+    struct timespec start, end; /* eval_mm_remote: when the frees ran */
+} thread_params_t;
+
+/* A live block of a streamed trace, in a live_map_t slot */
+typedef struct {
+    char *p;              /* payload returned by mm */
+    size_t size;          /* payload size requested */
+    int32_t id;           /* trace id, or -1 if the slot is empty */
+} live_t;
+
+/* The live blocks of a streamed trace: open addressing on the id */
+typedef struct {
+    live_t *slots;
+    size_t mask;          /* slots - 1; slots is a power of two */
+    size_t count;         /* live blocks */
+    int shift;            /* 64 - log2(slots), for the hash */
+} live_map_t;
+
+/* A trace being streamed: the prefetch thread fills the two chunks in turn */
+typedef struct {
+    FILE *in;
+    const char *name;
+    bool binary;          /* tracefmt.h ops rather than .rep lines */
+    long long num_ops;    /* ops the header promises, or 0 to read to EOF */
+    long long decoded;    /* ops decoded so far */
+    traceop_t *chunk[2];
+    uint64_t *huge[2];    /* each chunk's huge sizes, for a .rep stream */
+    uint64_t *file_huge;  /* the huge sizes of a binary stream */
+    uint32_t num_huge;    /* ... and how many there are */
+    int count[2];         /* ops in each chunk */
+    bool ready[2];        /* chunk decoded and not yet replayed */
+    bool last[2];         /* no chunks follow this one */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} stream_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -120,6 +181,8 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    double peak_heap;  /* most bytes of heap in use at once during the trace */
+    double end_heap;   /* bytes of heap still in use after the trace */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -132,6 +195,9 @@ typedef struct {
     double tput;  /* average throughput expressed in Kops/s */
 } sum_stats_t;
 
+/* Where a trace has got to in run_tests_parallel */
+typedef enum { JOB_QUEUED, JOB_CHECKING, JOB_CHECKED, JOB_TIMING, JOB_DONE } job_state_t;
+
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
  * at a "random" place (a hash of the index), and copy random data
@@ -160,6 +226,17 @@ static int errors = 0;           /* number of errs found when running student ma
 static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
 static size_t maxfill = MAXFILL;
+static int max_threads = 0;       /* Replay in up to this many threads (set by -P) */
+static int max_remote_threads = 0; /* Free remotely in up to this many threads (set by -R) */
+static int oversub_threads = 0;   /* Compare caches in this many threads (set by -X) */
+static bool percpu_caches = false; /* Run mm with per-CPU caches (set by -C) */
+static int resident_samples = 0;  /* Report resident memory this often per trace (set by -M) */
+static int page_policy = 0;       /* memlib MEM_HUGEPAGES and MEM_PREFAULT bits (set by -H and -F) */
+static size_t prefault_kb = 0;    /* Prefault chunk in KB, 0 for memlib's default (set by -F) */
+static char *stream_file = NULL;  /* Stream this trace, or - for stdin, instead of the tests (set by -S) */
+static int jobs = 0;              /* Check traces in this many worker processes (set by -j) */
+static cpu_set_t timed_cpus;      /* Time traces in workers pinned to these CPUs (set by -p) */
+static int num_timed_cpus = 0;    /* ... and how many there are */
 
 /* by default, no timeouts */
 static int set_timeout = 0;
@@ -206,6 +283,11 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static trace_t *load_trace(stats_t *stats, const char *tracedir,
+                           const char *filename);
+static uint32_t size_field(trace_t *trace, size_t size);
+static void parse_trace(trace_t *trace);
+static bool map_trace(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -216,11 +298,27 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void replay_mm(trace_t *trace, char **blocks);
+static void replay_mm_ops(trace_t *trace, char **blocks, int first, int last);
+static void *replay_mm_thread(void *ptr);
+static double eval_mm_threads(trace_t *trace, int nthreads);
+static void *free_mm_thread(void *ptr);
+static double eval_mm_remote(trace_t *trace, int nthreads);
+static void run_thread_tests(int num_tracefiles, const char *tracedir,
+                             char **tracefiles, const char *title, int max,
+                             double (*eval)(trace_t *trace, int nthreads));
+static void run_oversub_tests(int num_tracefiles, const char *tracedir,
+                              char **tracefiles, int nthreads);
+static void run_resident_tests(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, int samples);
+static void run_stream(const char *filename);
+static bool parse_cpus(const char *list, cpu_set_t *cpus);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printheap(int n, stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -242,64 +340,756 @@ static void timeout_handler(int sig __attribute__((unused))) {
 static double measure_ref_throughput();
 
 /*
- * Run the tests; return the number of tests run (may be less than
- * num_tracefiles, if there's a timeout)
+ * run_test - run the tests of run_tests on trace i, on a fresh heap.
+ *            Returns false once -c has had the one check it asks for.
  */
-static void run_tests(int num_tracefiles, const char *tracedir,
-                      char **tracefiles, 
-                      stats_t *mm_stats, speed_t *speed_params) {
-    volatile int i;
+static bool run_test(int i, const char *tracedir, char **tracefiles,
+                     stats_t *mm_stats, speed_t *speed_params, int tests) {
+    range_set_t *ranges;
+    trace_t *trace;
+    bool more = true;
+
+    /* initialize simulated memory system in memlib.c *
+     * start each trace with a clean system */
+    mem_init();
+    ranges = new_range_set();
+    /* A timed run of a trace checked earlier, as -j does, says so */
+    if (tests & TEST_CHECK) {
+        trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
+    } else {
+        if (verbose > 1)
+            printf("Timing tracefile: %s\n", tracefiles[i]);
+        trace = load_trace(&mm_stats[i], tracedir, tracefiles[i]);
+    }
+    strcpy(mm_stats[i].filename, trace->filename);
+    mm_stats[i].ops = trace->num_ops;
 
-    for (i=0; i < num_tracefiles; i++) {
-        /* initialize simulated memory system in memlib.c *
-         * start each trace with a clean system */
-        mem_init();
-        range_set_t *ranges = new_range_set();
+    if (tests & TEST_CHECK) {
+        if (verbose > 1)
+            printf("Checking mm_malloc for correctness, ");
+        mm_stats[i].valid =
+            /* Do 2 tests, since may fail to reinitialize properly */
+            eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
+        more = !onetime_flag;
+    }
+    if (more && mm_stats[i].valid && (tests & TEST_CHECK)) {
+        if (verbose > 1)
+            printf("efficiency, ");
+        mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
+    }
+    if (more && mm_stats[i].valid && (tests & TEST_TIME)) {
+        speed_params->trace = trace;
+        if (verbose > 1 && (tests & TEST_CHECK))
+            printf("and performance.\n");
+        mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
+    }
 
+#if 0
+    printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
+           trace->num_ops, ranges->lo_tree->comparison_count,
+           (double) ranges->lo_tree->comparison_count / trace->num_ops);
+#endif
+    /* End the progress line of a check that is not timed here, so that
+       a worker's log does not run into the next one */
+    if (verbose > 1 && (tests & TEST_CHECK) &&
+        !(more && mm_stats[i].valid && (tests & TEST_TIME)))
+        printf("\n");
+    free_trace(trace);
+    free_range_set(ranges);
 
-        // NOTE: If times out, then it will reread the trace file 
+    /* clean up memory system */
+    mem_deinit();
+    return more;
+}
 
-        trace_t *trace;
-        trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
-        strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
+/*
+ * Run the tests on traces first to last - 1: correctness and
+ * utilization for TEST_CHECK, the timed runs for TEST_TIME.  Timed
+ * runs need a trace that the checks found valid.
+ */
+static void run_tests(int first, int last, const char *tracedir,
+                      char **tracefiles, stats_t *mm_stats,
+                      speed_t *speed_params, int tests) {
+    volatile int i;
 
-        /* Prepare for timeout */
+    for (i=first; i < last; i++) {
+        /* Prepare for timeout.  The trace that runs out of time is
+           abandoned where it stands: run_test's pointers to it are
+           gone with its frame, so nothing here can touch them. */
         if (setjmp(timeout_jmpbuf) != 0) {
             mm_stats[i].valid = false;
+            mem_deinit();
+            continue;
+        }
+        if (!run_test(i, tracedir, tracefiles, mm_stats, speed_params, tests))
+            return;
+    }
+}
+
+/*
+ * shared_calloc - n zeroed bytes that forked workers write into and
+ *                 the parent sees
+ */
+static void *shared_calloc(size_t n)
+{
+    void *p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+        unix_error("mmap failed in shared_calloc");
+    return p;
+}
+
+/*
+ * start_job - fork a worker that runs tests on trace i into its slot
+ *             of stats and job_errors, with its output going to log
+ *             and, unless cpus is NULL, only on those CPUs.  Returns
+ *             the worker's pid.
+ */
+static pid_t start_job(int i, int tests, const char *tracedir, char **tracefiles,
+                       stats_t *stats, int *job_errors, speed_t *speed_params,
+                       FILE *log, const cpu_set_t *cpus)
+{
+    pid_t pid;
+
+    /* A worker that exits through exit() flushes whatever stdio buffers
+       it inherited, so leave it none to write out a second time */
+    fflush(NULL);
+    if ((pid = fork()) < 0)
+        unix_error("fork failed in start_job");
+    if (pid > 0)
+        return pid;
+
+    if (cpus != NULL && sched_setaffinity(0, sizeof(*cpus), cpus) < 0)
+        unix_error("sched_setaffinity failed in start_job");
+    if (dup2(fileno(log), STDOUT_FILENO) < 0)
+        unix_error("dup2 failed in start_job");
+    errors = 0;
+    if (set_timeout > 0)
+        alarm(set_timeout);
+    run_tests(i, i + 1, tracedir, tracefiles, stats, speed_params, tests);
+    job_errors[i] += errors;
+    _exit(0);
+}
+
+/*
+ * Run the tests as run_tests does, but check up to jobs traces at once,
+ * each in a worker process with a heap of its own.  The timed runs go
+ * one at a time in this process once every check is done or, with -p,
+ * to workers pinned one to each dedicated CPU as traces pass their
+ * checks, while the checks keep to the other CPUs.  Each worker's
+ * output is held back and printed in trace order, and its results land
+ * in the trace's slot of mm_stats, so a run prints the same whatever
+ * order the workers finish in.  With -s, each worker and each timed run
+ * gets the whole timeout.
+ */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params) {
+    stats_t *stats = shared_calloc(num_tracefiles * sizeof(stats_t));
+    int *job_errors = shared_calloc(num_tracefiles * sizeof(int));
+    job_state_t *state;
+    pid_t *pids, pid;
+    FILE **logs;
+    cpu_set_t check_cpus, cpu, *check_set = NULL;
+    int cpu_trace[CPU_SETSIZE];   /* trace timed on each dedicated CPU, or -1 */
+    int cpu_ids[CPU_SETSIZE];     /* the dedicated CPUs */
+    int i, k, c, status, checking = 0, timing = 0, to_time = 0, next_check = 0;
+
+    if (jobs < 1)
+        jobs = 1;
+    state = calloc(num_tracefiles, sizeof(*state));
+    pids = calloc(num_tracefiles, sizeof(*pids));
+    logs = calloc(num_tracefiles, sizeof(*logs));
+    if (state == NULL || pids == NULL || logs == NULL)
+        unix_error("calloc failed in run_tests_parallel");
+    for (i = 0; i < num_tracefiles; i++) {
+        if ((logs[i] = tmpfile()) == NULL)
+            unix_error("tmpfile failed in run_tests_parallel");
+    }
+
+    /* Keep the checks off the dedicated CPUs, if that leaves them any */
+    for (c = 0, k = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &timed_cpus)) {
+            cpu_ids[k] = c;
+            cpu_trace[k++] = -1;
+        }
+    }
+    if (num_timed_cpus > 0 && sched_getaffinity(0, sizeof(check_cpus), &check_cpus) == 0) {
+        for (k = 0; k < num_timed_cpus; k++)
+            CPU_CLR(cpu_ids[k], &check_cpus);
+        if (CPU_COUNT(&check_cpus) > 0)
+            check_set = &check_cpus;
+    }
+
+    /* The workers time themselves out */
+    alarm(0);
+    while (checking > 0 || timing > 0 || next_check < num_tracefiles || to_time > 0) {
+        /* Start checks in trace order, up to jobs at once */
+        while (checking < jobs && next_check < num_tracefiles) {
+            i = next_check++;
+            pids[i] = start_job(i, TEST_CHECK, tracedir, tracefiles, stats, job_errors,
+                                speed_params, logs[i], check_set);
+            state[i] = JOB_CHECKING;
+            checking++;
+        }
+
+        /* Time checked traces in trace order, one to each idle dedicated CPU */
+        for (i = 0; i < num_tracefiles && to_time > 0 && timing < num_timed_cpus; i++) {
+            if (state[i] != JOB_CHECKED)
+                continue;
+            for (k = 0; cpu_trace[k] >= 0; k++)
+                ;
+            CPU_ZERO(&cpu);
+            CPU_SET(cpu_ids[k], &cpu);
+            pids[i] = start_job(i, TEST_TIME, tracedir, tracefiles, stats, job_errors,
+                                speed_params, logs[i], &cpu);
+            cpu_trace[k] = i;
+            state[i] = JOB_TIMING;
+            to_time--;
+            timing++;
+        }
+
+        if ((pid = wait(&status)) < 0)
+            unix_error("wait failed in run_tests_parallel");
+        for (i = 0; i < num_tracefiles && pids[i] != pid; i++)
+            ;
+        if (i == num_tracefiles)
+            continue;
+        pids[i] = 0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            stats[i].valid = false;
+            job_errors[i]++;
+            fseek(logs[i], 0, SEEK_END);
+            if (WIFSIGNALED(status))
+                fprintf(logs[i], "ERROR [trace %s]: worker died: %s\n",
+                        tracefiles[i], strsignal(WTERMSIG(status)));
+            else
+                fprintf(logs[i], "ERROR [trace %s]: worker exited with status %d\n",
+                        tracefiles[i], WEXITSTATUS(status));
+        }
+        if (state[i] == JOB_CHECKING) {
+            checking--;
+            state[i] = stats[i].valid ? JOB_CHECKED : JOB_DONE;
+            if (state[i] == JOB_CHECKED && num_timed_cpus > 0)
+                to_time++;
         } else {
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid =
-                /* Do 2 tests, since may fail to reinitialize properly */
-                eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
-
-            if (onetime_flag) {
-                free_trace(trace);
-                return;
-            }
+            timing--;
+            for (k = 0; cpu_trace[k] != i; k++)
+                ;
+            cpu_trace[k] = -1;
+            state[i] = JOB_DONE;
         }
-        if (mm_stats[i].valid) {
-            if (verbose > 1)
-                printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
-            speed_params->trace = trace;
-            if (verbose > 1)
-                printf("and performance.\n");
-            mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
+    }
+
+    /* Merge in trace order */
+    for (i = 0; i < num_tracefiles; i++) {
+        rewind(logs[i]);
+        while ((c = getc(logs[i])) != EOF)
+            putchar(c);
+        fclose(logs[i]);
+        errors += job_errors[i];
+    }
+
+    /* Without dedicated CPUs, the timed runs have the machine to themselves */
+    for (i = 0; i < num_tracefiles; i++) {
+        if (state[i] != JOB_CHECKED)
+            continue;
+        if (set_timeout > 0)
+            alarm(set_timeout);
+        run_tests(i, i + 1, tracedir, tracefiles, stats, speed_params, TEST_TIME);
+        alarm(0);
+    }
+
+    memcpy(mm_stats, stats, num_tracefiles * sizeof(stats_t));
+    munmap(stats, num_tracefiles * sizeof(stats_t));
+    munmap(job_errors, num_tracefiles * sizeof(int));
+    free(state);
+    free(pids);
+    free(logs);
+}
+
+/*
+ * Run eval on every trace with 1, 2, 4, ... max threads, and print the
+ * aggregate throughput it returns and the speedup over one thread.
+ */
+static void run_thread_tests(int num_tracefiles, const char *tracedir,
+                             char **tracefiles, const char *title, int max,
+                             double (*eval)(trace_t *trace, int nthreads)) {
+    int i, nthreads;
+    stats_t stats;
+    trace_t *trace;
+    double kops, base_kops;
+
+    printf("Results for mm malloc %s:\n", title);
+    printf("%8s%10s%9s  %s\n", "threads", "Kops", "speedup", "trace");
+    for (i = 0; i < num_tracefiles; i++) {
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        base_kops = 0;
+        for (nthreads = 1; nthreads <= max; nthreads *= 2) {
+            kops = eval(trace, nthreads);
+            if (nthreads == 1)
+                base_kops = kops;
+            printf("%8d%10.0f%8.2fx  %s\n", nthreads, kops,
+                   base_kops > 0 ? kops / base_kops : 0.0, trace->filename);
         }
+        free_trace(trace);
+        mem_deinit();
+    }
+    printf("\n");
+}
 
-#if 0
-        printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
-               trace->num_ops, ranges->lo_tree->comparison_count,
-               (double) ranges->lo_tree->comparison_count / trace->num_ops);
-#endif
+/*
+ * Replay every trace in nthreads threads at once, typically many more
+ * than there are CPUs, first with per-thread and then with per-CPU
+ * caches, and print the throughput and the heap each one ends up with.
+ */
+static void run_oversub_tests(int num_tracefiles, const char *tracedir,
+                              char **tracefiles, int nthreads) {
+    static const char *cache_names[] = { "thread", "cpu" };
+    int i, percpu;
+    stats_t stats;
+    trace_t *trace;
+    double kops;
+    bool have_rseq = mm_percpu_caches(true);
+
+    printf("Results for mm malloc in %d threads on %ld CPUs%s:\n", nthreads,
+           sysconf(_SC_NPROCESSORS_ONLN),
+           have_rseq ? "" : " (no rseq, so per-CPU runs use per-thread caches)");
+    printf("%8s%10s%10s  %s\n", "cache", "Kops", "heap KB", "trace");
+    for (i = 0; i < num_tracefiles; i++) {
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        for (percpu = 0; percpu <= 1; percpu++) {
+            mm_percpu_caches(percpu);
+            kops = eval_mm_threads(trace, nthreads);
+            printf("%8s%10.0f%10.0f  %s\n", cache_names[percpu], kops,
+                   (mem_heapsize() + mem_mapsize()) / 1024.0, trace->filename);
+        }
         free_trace(trace);
-        free_range_set(ranges);
+        mem_deinit();
+    }
+    mm_percpu_caches(percpu_caches);
+    printf("\n");
+}
+
+/*
+ * Replay every trace in samples steps, and after each print the heap
+ * size next to the bytes of it still resident, the bytes the package
+ * has purged so far and the page faults the replay has taken, which is
+ * what purging costs.
+ */
+static void run_resident_tests(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, int samples) {
+    int i, k, first, last;
+    long faults;
+    size_t purged;
+    stats_t stats;
+    trace_t *trace;
 
-        /* clean up memory system */
+    printf("Resident memory for mm malloc:\n");
+    printf("%10s%10s%12s%10s%10s  %s\n", "ops", "heap KB", "resident KB",
+           "purged KB", "faults", "trace");
+    for (i = 0; i < num_tracefiles; i++) {
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        reinit_trace(trace);
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in run_resident_tests");
+        faults = mem_page_faults();
+        purged = mem_purgesize();
+        for (k = 1, first = 0; k <= samples; k++, first = last) {
+            last = (int)((long)trace->num_ops * k / samples);
+            replay_mm_ops(trace, trace->blocks, first, last);
+            printf("%10d%10.0f%12.0f%10.0f%10ld  %s\n", last,
+                   (mem_heapsize() + mem_mapsize()) / 1024.0,
+                   mem_resident() / 1024.0, (mem_purgesize() - purged) / 1024.0,
+                   mem_page_faults() - faults, trace->filename);
+        }
+        free_trace(trace);
         mem_deinit();
     }
+    printf("\n");
+}
+
+/*
+ * The live_map routines keep the blocks of a streamed trace by id, so
+ * that memory follows the live blocks rather than every id the trace
+ * ever uses.  Linear probing, with deletion by shifting back the rest
+ * of the cluster, so no tombstones build up over a long stream.
+ */
+static void live_map_init(live_map_t *map, int bits)
+{
+    size_t i, slots = (size_t) 1 << bits;
+
+    if ((map->slots = malloc(slots * sizeof(live_t))) == NULL)
+        unix_error("malloc failed in live_map_init");
+    for (i = 0; i < slots; i++)
+        map->slots[i].id = -1;
+    map->mask = slots - 1;
+    map->count = 0;
+    map->shift = 64 - bits;
+}
+
+static inline size_t live_home(const live_map_t *map, int32_t id)
+{
+    return (size_t)(((uint64_t)(uint32_t) id * 0x9E3779B97F4A7C15ull) >> map->shift);
+}
+
+/* live_map_find - the slot holding id, or the empty slot it would go in */
+static live_t *live_map_find(const live_map_t *map, int32_t id)
+{
+    size_t i = live_home(map, id);
+
+    while (map->slots[i].id != id && map->slots[i].id != -1)
+        i = (i + 1) & map->mask;
+    return &map->slots[i];
+}
+
+static void live_map_put(live_map_t *map, int32_t id, char *p, size_t size)
+{
+    live_map_t old;
+    live_t *e;
+    size_t i;
+
+    /* Keep the table at most half full */
+    if (2 * (map->count + 1) > map->mask + 1) {
+        old = *map;
+        live_map_init(map, 64 - old.shift + 1);
+        for (i = 0; i <= old.mask; i++) {
+            if (old.slots[i].id != -1)
+                *live_map_find(map, old.slots[i].id) = old.slots[i];
+        }
+        map->count = old.count;
+        free(old.slots);
+    }
+    e = live_map_find(map, id);
+    if (e->id == -1)
+        map->count++;
+    e->id = id;
+    e->p = p;
+    e->size = size;
+}
+
+static void live_map_remove(live_map_t *map, live_t *e)
+{
+    size_t i = e - map->slots;
+    size_t j = i, home;
+
+    /* Move back each later entry of the cluster that may not skip the hole */
+    for (;;) {
+        j = (j + 1) & map->mask;
+        if (map->slots[j].id == -1)
+            break;
+        home = live_home(map, map->slots[j].id);
+        if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+            map->slots[i] = map->slots[j];
+            i = j;
+        }
+    }
+    map->slots[i].id = -1;
+    map->count--;
+}
+
+/*
+ * stream_decode - decode up to max ops from s->in into ops, and the
+ *                 sizes they escape into huge.  Returns how many ops,
+ *                 fewer only at the end of the trace.
+ */
+static int stream_decode(stream_t *s, traceop_t *ops, uint64_t *huge, int max)
+{
+    char type[MAXLINE];
+    unsigned long long size;
+    long index;
+    unsigned op_type;
+    uint32_t num_huge = 0;
+    int n;
+
+    if (s->num_ops > 0 && s->num_ops - s->decoded < max)
+        max = (int)(s->num_ops - s->decoded);
+    if (s->binary) {
+        n = (int) fread(ops, sizeof(traceop_t), max, s->in);
+        for (index = 0; index < n; index++) {
+            if (ops[index].size >= TRACE_HUGE && ops[index].size - TRACE_HUGE >= s->num_huge)
+                app_error("%s: bad request %lld", s->name, s->decoded + index);
+        }
+        s->decoded += n;
+        return n;
+    }
+    for (n = 0; n < max && fscanf(s->in, "%s", type) == 1; n++) {
+        size = 0;
+        switch (type[0]) {
+            case 'a':
+            case 'r':
+                if (fscanf(s->in, "%ld %llu", &index, &size) != 2)
+                    app_error("%s: bad request after op %lld", s->name, s->decoded + n);
+                op_type = type[0] == 'a' ? ALLOC : REALLOC;
+                break;
+            case 'f':
+                if (fscanf(s->in, "%ld", &index) != 1)
+                    app_error("%s: bad request after op %lld", s->name, s->decoded + n);
+                op_type = FREE;
+                break;
+            default:
+                app_error("Bogus type character (%c) in tracefile %s\n",
+                          type[0], s->name);
+        }
+        if (index < -1 || index >= (long) TRACE_MAX_IDS)
+            app_error("%s: id %ld after op %lld is out of range", s->name, index,
+                      s->decoded + n);
+        if (size >= TRACE_HUGE) {
+            huge[num_huge] = size;
+            ops[n] = trace_op(op_type, (int32_t) index, TRACE_HUGE + num_huge++);
+        } else {
+            ops[n] = trace_op(op_type, (int32_t) index, (uint32_t) size);
+        }
+    }
+    s->decoded += n;
+    return n;
+}
+
+/*
+ * stream_prefetch - the prefetch thread: decode the trace into each
+ *                   chunk in turn as soon as the replay is done with it
+ */
+static void *stream_prefetch(void *ptr)
+{
+    stream_t *s = ptr;
+    int k, n;
+    bool last;
+
+    for (k = 0; ; k ^= 1) {
+        pthread_mutex_lock(&s->lock);
+        while (s->ready[k])
+            pthread_cond_wait(&s->cond, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+
+        n = stream_decode(s, s->chunk[k], s->huge[k], STREAM_CHUNK);
+        last = n < STREAM_CHUNK || (s->num_ops > 0 && s->decoded == s->num_ops);
+
+        pthread_mutex_lock(&s->lock);
+        s->count[k] = n;
+        s->last[k] = last;
+        s->ready[k] = true;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (last)
+            return NULL;
+    }
+}
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) * 1e-9;
+}
+
+/*
+ * stream_error - report a bad result from mm at op opnum of a stream
+ */
+static void stream_error(const stream_t *s, long long opnum, const char *msg)
+{
+    errors++;
+    printf("ERROR [stream %s, op %lld]: %s\n", s->name, opnum, msg);
+    fflush(NULL);
+}
+
+/*
+ * run_stream - replay the trace in filename, or on stdin if filename
+ *              is -, as it is read, in memory that grows with the live
+ *              blocks rather than with the trace.  Each result is
+ *              checked for NULL and alignment only; the table gives the
+ *              time spent in the replay, excluding waits for the
+ *              prefetch thread, which are shown apart.
+ */
+static void run_stream(const char *filename)
+{
+    stream_t s;
+    live_map_t map;
+    live_t *e;
+    pthread_t prefetch;
+    struct timespec start, end, wait_start, wait_end;
+    traceop_t *op, *ops_end;
+    const uint64_t *huge;
+    unsigned type;
+    int32_t index;
+    size_t size;
+    size_t total_size = 0, max_total_size = 0, heap_size, max_heap_size = 0;
+    double secs = 0, stall = 0;
+    long long opnum = 0, next_report = STREAM_REPORT;
+    char *p;
+    int k, c;
+    bool last = false;
+
+    memset(&s, 0, sizeof(s));
+    s.name = filename;
+    if (strcmp(filename, "-") == 0) {
+        s.in = stdin;
+        s.name = "stdin";
+    } else if ((s.in = fopen(filename, "r")) == NULL) {
+        unix_error("Could not open %s in run_stream", filename);
+    }
+
+    /* A binary trace starts with TRACE_MAGIC, a .rep file with a digit */
+    if ((c = getc(s.in)) == EOF)
+        app_error("%s: empty trace", s.name);
+    ungetc(c, s.in);
+    if (c == TRACE_MAGIC[0]) {
+        trace_header_t hdr;
+        if (fread(&hdr, sizeof(hdr), 1, s.in) != 1 ||
+            memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != TRACE_VERSION)
+            app_error("%s: not a version %d binary trace", s.name, TRACE_VERSION);
+        s.binary = true;
+        s.num_ops = hdr.num_ops;
+        s.num_huge = hdr.num_huge;
+        if ((s.file_huge = malloc((hdr.num_huge + 1) * sizeof(uint64_t))) == NULL)
+            unix_error("malloc failed in run_stream");
+        if (fread(s.file_huge, sizeof(uint64_t), hdr.num_huge, s.in) != hdr.num_huge)
+            app_error("%s: truncated huge sizes", s.name);
+    } else {
+        long weight, num_ids;
+        unsigned long long data_bytes;
+        if (fscanf(s.in, "%ld %ld %lld %llu", &weight, &num_ids, &s.num_ops,
+                   &data_bytes) != 4)
+            app_error("%s: bad trace header", s.name);
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    for (k = 0; k < 2; k++) {
+        if ((s.chunk[k] = malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL ||
+            (!s.binary && (s.huge[k] = malloc(STREAM_CHUNK * sizeof(uint64_t))) == NULL))
+            unix_error("malloc failed in run_stream");
+    }
+    live_map_init(&map, 10);
+    errno = pthread_create(&prefetch, NULL, stream_prefetch, &s);
+    if (errno != 0)
+        unix_error("pthread_create failed in run_stream");
+
+    mem_init();
+    if (!mm_init())
+        app_error("mm_init failed in run_stream");
+
+    printf("Streaming %s:\n", s.name);
+    printf("%14s%10s%10s%10s%12s%12s%8s\n", "ops", "secs", "stall", "Kops",
+           "payload KB", "heap KB", "util");
+    for (k = 0; !last; k ^= 1) {
+        clock_gettime(CLOCK_MONOTONIC, &wait_start);
+        pthread_mutex_lock(&s.lock);
+        while (!s.ready[k])
+            pthread_cond_wait(&s.cond, &s.lock);
+        last = s.last[k];
+        pthread_mutex_unlock(&s.lock);
+        clock_gettime(CLOCK_MONOTONIC, &wait_end);
+        stall += elapsed(&wait_start, &wait_end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        huge = s.binary ? s.file_huge : s.huge[k];
+        for (op = s.chunk[k], ops_end = op + s.count[k]; op < ops_end; op++, opnum++) {
+            type = trace_op_type(*op);
+            index = trace_op_index(*op);
+            size = trace_op_size(*op, huge);
+            switch (type) {
+                case ALLOC:
+                    if (index < 0) {
+                        stream_error(&s, opnum, "Negative id.");
+                        break;
+                    }
+                    if (live_map_find(&map, index)->id != -1) {
+                        stream_error(&s, opnum, "Id allocated twice.");
+                        break;
+                    }
+                    if ((p = mm_malloc(size)) == NULL) {
+                        stream_error(&s, opnum, "mm_malloc failed.");
+                        break;
+                    }
+                    if (!IS_ALIGNED(p))
+                        stream_error(&s, opnum, "Payload address is not aligned.");
+                    live_map_put(&map, index, p, size);
+                    total_size += size;
+                    break;
+
+                case REALLOC:
+                    if (index < 0) {
+                        stream_error(&s, opnum, "Negative id.");
+                        break;
+                    }
+                    e = live_map_find(&map, index);
+                    p = mm_realloc(e->id == -1 ? NULL : e->p, size);
+                    if (p == NULL && size != 0) {
+                        stream_error(&s, opnum, "mm_realloc failed.");
+                        break;
+                    }
+                    if (!IS_ALIGNED(p))
+                        stream_error(&s, opnum, "Payload address is not aligned.");
+                    total_size -= e->id == -1 ? 0 : e->size;
+                    total_size += size;
+                    if (e->id != -1) {
+                        e->p = p;
+                        e->size = size;
+                    } else {
+                        live_map_put(&map, index, p, size);
+                    }
+                    break;
+
+                case FREE:
+                    if (index < 0) {
+                        mm_free(NULL);
+                        break;
+                    }
+                    if ((e = live_map_find(&map, index))->id == -1) {
+                        stream_error(&s, opnum, "Free of an id that is not live.");
+                        break;
+                    }
+                    mm_free(e->p);
+                    total_size -= e->size;
+                    live_map_remove(&map, e);
+                    break;
+
+                default:
+                    stream_error(&s, opnum, "Nonexistent request type.");
+                    break;
+            }
+
+            /* update the high-water marks */
+            max_total_size = (total_size > max_total_size) ?
+                total_size : max_total_size;
+            heap_size = mem_heapsize() + mem_mapsize();
+            max_heap_size = (heap_size > max_heap_size) ?
+                heap_size : max_heap_size;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs += elapsed(&start, &end);
+
+        pthread_mutex_lock(&s.lock);
+        s.ready[k] = false;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+
+        if (last || (verbose > 1 && opnum >= next_report)) {
+            printf("%14lld%10.3f%10.3f%10.0f%12.0f%12.0f%7.1f%%\n", opnum, secs,
+                   stall, secs > 0 ? opnum / secs * 0.001 : 0.0,
+                   max_total_size / 1024.0, max_heap_size / 1024.0,
+                   max_heap_size ? 100.0 * max_total_size / max_heap_size : 0.0);
+            fflush(stdout);
+            next_report += STREAM_REPORT;
+        }
+    }
+    pthread_join(prefetch, NULL);
+    if (s.num_ops > 0 && opnum != s.num_ops)
+        stream_error(&s, opnum, "Trace ended before the ops its header promises.");
+    printf("%zu blocks still live at the end\n", map.count);
+
+    free(map.slots);
+    free(s.chunk[0]);
+    free(s.chunk[1]);
+    free(s.huge[0]);
+    free(s.huge[1]);
+    free(s.file_huge);
+    if (s.in != stdin)
+        fclose(s.in);
+    mem_deinit();
 }
 
 double score_component(double perf, double min_perf, double max_perf)
@@ -353,10 +1143,11 @@ int main(int argc, char **argv)
     double ref_throughput;
 
     int c;
+    cpu_set_t allowed_cpus;    /* CPUs this process may run on, to check -p against */
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:P:R:X:M:F:S:j:p:hOVlDTCH")) != EOF) {
         switch (c) {
 
             case 'f': /* Use one specific trace file only (relative to curr dir) */
@@ -406,6 +1197,55 @@ int main(int argc, char **argv)
                 tab_mode = true;
                 break;
 
+            case 'P': /* Replay the traces in up to n threads as well */
+                max_threads = atoi(optarg);
+                break;
+
+            case 'R': /* Free blocks from up to n other threads */
+                max_remote_threads = atoi(optarg);
+                break;
+
+            case 'X': /* Compare per-thread and per-CPU caches in n threads */
+                oversub_threads = atoi(optarg);
+                break;
+
+            case 'M': /* Report resident memory at n points of each trace */
+                resident_samples = atoi(optarg);
+                break;
+
+            case 'C': /* Use per-CPU caches */
+                percpu_caches = true;
+                break;
+
+            case 'S': /* Stream one trace, or stdin, instead of the tests */
+                stream_file = optarg;
+                break;
+
+            case 'H': /* Back the heap with transparent huge pages */
+                page_policy |= MEM_HUGEPAGES;
+                break;
+
+            case 'F': /* Prefault each heap growth in chunks of n KB */
+                page_policy |= MEM_PREFAULT;
+                prefault_kb = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'j': /* Check up to n traces at once in worker processes */
+                jobs = atoi(optarg);
+                break;
+
+            case 'p': /* Time traces in workers pinned to these CPUs */
+                if (!parse_cpus(optarg, &timed_cpus))
+                    app_error("-p takes a list of CPUs such as 2,3 or 4-7, not %s\n", optarg);
+                if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) < 0)
+                    unix_error("sched_getaffinity failed in main");
+                for (c = 0; c < CPU_SETSIZE; c++) {
+                    if (CPU_ISSET(c, &timed_cpus) && !CPU_ISSET(c, &allowed_cpus))
+                        app_error("-p: CPU %d is not one this process may run on\n", c);
+                }
+                num_timed_cpus = CPU_COUNT(&timed_cpus);
+                break;
+
             case 'h': /* Print this message */
                 usage(argv[0]);
                 exit(0);
@@ -427,12 +1267,23 @@ int main(int argc, char **argv)
         init_random_data();
     }
 
+    mem_set_policy(page_policy, prefault_kb * 1024);
+
+    if (percpu_caches && !mm_percpu_caches(true))
+        printf("No rseq here, so -C falls back to per-thread caches\n");
+
     /* Initialize the timeout */
     if (set_timeout > 0) {
         signal(SIGALRM, timeout_handler);
         alarm(set_timeout); 
     }
 
+    /* Streaming replaces the tests: there is no trace in memory to time */
+    if (stream_file != NULL) {
+        run_stream(stream_file);
+        exit(errors ? 1 : 0);
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package
      */
@@ -500,8 +1351,12 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
-              &speed_params);
+    if ((jobs > 1 || num_timed_cpus > 0) && !onetime_flag)
+        run_tests_parallel(num_global_tracefiles, tracedir, global_tracefiles,
+                           mm_stats, &speed_params);
+    else
+        run_tests(0, num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
+                  &speed_params, TEST_CHECK | TEST_TIME);
 
 
     /* Display the mm results in a compact table */
@@ -518,9 +1373,26 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (verbose > 1)
+                printheap(num_global_tracefiles, mm_stats);
         }
     }
 
+    /* Optionally measure how mm scales over threads */
+    if (max_threads > 0 && !onetime_flag)
+        run_thread_tests(num_global_tracefiles, tracedir, global_tracefiles,
+                         "in concurrent threads", max_threads, eval_mm_threads);
+    if (max_remote_threads > 0 && !onetime_flag)
+        run_thread_tests(num_global_tracefiles, tracedir, global_tracefiles,
+                         "frees from other threads", max_remote_threads,
+                         eval_mm_remote);
+    if (oversub_threads > 0 && !onetime_flag)
+        run_oversub_tests(num_global_tracefiles, tracedir, global_tracefiles,
+                          oversub_threads);
+    if (resident_samples > 0 && !onetime_flag)
+        run_resident_tests(num_global_tracefiles, tracedir, global_tracefiles,
+                           resident_samples);
+
     /* Optionally compare the performance of mm and libc */
     if (run_libc) {
         printf("Comparison with libc malloc: mm/libc = %.0f Kops / %.0f Kops = %.2f\n", 
@@ -666,6 +1538,35 @@ int main(int argc, char **argv)
 }
 
 
+/*
+ * parse_cpus - read a list of CPUs such as 0,2,4-7 into cpus.  Returns
+ *              false if the list is malformed or empty.
+ */
+static bool parse_cpus(const char *list, cpu_set_t *cpus)
+{
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(cpus);
+    do {
+        lo = hi = strtol(list, &end, 10);
+        if (end == list)
+            return false;
+        if (*end == '-') {
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+            if (end == list)
+                return false;
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+            return false;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, cpus);
+        list = end + 1;
+    } while (*end == ',');
+    return *end == '\0';
+}
+
 /*****************************************************************
  * Add trace to global list of tracefiles
  ****************************************************************/
@@ -712,9 +1613,11 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of one
+       mapped extent */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_map(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -924,30 +1827,95 @@ static bool check_index(const trace_t *trace, int opnum, int index, int realloc)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - say which trace file is read, and load_trace it
  */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
 {
-    FILE *tracefile;
-    trace_t *trace;
-    char type[MAXLINE];
-    int index;
-    size_t size;
-    int max_index = 0;
-    int op_index;
-    int ignore = 0;
-
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
+    return load_trace(stats, tracedir, filename);
+}
+
+/*
+ * load_trace - read a trace file and store it in memory
+ */
+static trace_t *load_trace(stats_t *stats, const char *tracedir,
+                           const char *filename)
+{
+    trace_t *trace;
 
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trace");
 
-    /* Read the trace file header */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
+
+    /* Binary traces need no parsing; their ops are used where they lie */
+    if (!map_trace(trace))
+        parse_trace(trace);
+
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks =
+         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes =
+         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in read_trace");
+
+    /* and, if we're debugging, the offset into the random data */
+    if ((trace->block_rand_base =
+         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+        unix_error("malloc 5 failed in read_trace");
+
+    /* fill in the stats */
+    strcpy(stats->filename, trace->filename);
+    stats->weight = trace->weight;
+    stats->ops = trace->num_ops;
+
+    return trace;
+}
+
+/*
+ * size_field - the size field of an op of size bytes in trace: size
+ *              itself if it fits, else a new entry in trace->huge
+ */
+static uint32_t size_field(trace_t *trace, size_t size)
+{
+    uint64_t *huge;
+
+    if (size < TRACE_HUGE)
+        return (uint32_t) size;
+    /* Grow by doubling; the table is empty in all but a few traces */
+    if ((trace->num_huge & (trace->num_huge - 1)) == 0) {
+        huge = realloc(trace->huge, (trace->num_huge ? 2 * trace->num_huge : 1) *
+                       sizeof(uint64_t));
+        if (huge == NULL)
+            unix_error("realloc failed in read_trace");
+        trace->huge = huge;
+    }
+    trace->huge[trace->num_huge] = size;
+    return TRACE_HUGE + trace->num_huge++;
+}
+
+/*
+ * parse_trace - read the header and requests of the .rep file named
+ *               by trace->filename into trace
+ */
+static void parse_trace(trace_t *trace)
+{
+    FILE *tracefile;
+    char type[MAXLINE];
+    int index;
+    size_t size;
+    int max_index = 0;
+    int op_index;
+    int ignore = 0;
+
+    /* Read the trace file header */
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
@@ -961,27 +1929,17 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if (((unsigned int)trace->weight) > 3u) {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
     }
+    if ((unsigned int)trace->num_ids > TRACE_MAX_IDS) {
+        app_error("%s: ids can only go up to %u", trace->filename, TRACE_MAX_IDS - 1);
+    }
 
     /* We'll store each request line in the trace in this array */
     if ((trace->ops =
          (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
-
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks =
-         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
-        unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes =
-         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
-        unix_error("malloc 4 failed in read_trace");
-
-    /* and, if we're debugging, the offset into the random data */
-    if ((trace->block_rand_base =
-         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-        unix_error("malloc 5 failed in read_trace");
-
+    trace->map = NULL;
+    trace->huge = NULL;
+    trace->num_huge = 0;
 
     /* read every request line in the trace file */
     index = 0;
@@ -990,22 +1948,17 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         switch(type[0]) {
             case 'a':
                 ignore += fscanf(tracefile, "%u %lu", &index, &size);
-                trace->ops[op_index].type = ALLOC;
-                trace->ops[op_index].index = index;
-                trace->ops[op_index].size = size;
+                trace->ops[op_index] = trace_op(ALLOC, index, size_field(trace, size));
                 max_index = (index > max_index) ? index : max_index;
                 break;
             case 'r':
                 ignore += fscanf(tracefile, "%u %lu", &index, &size);
-                trace->ops[op_index].type = REALLOC;
-                trace->ops[op_index].index = index;
-                trace->ops[op_index].size = size;
+                trace->ops[op_index] = trace_op(REALLOC, index, size_field(trace, size));
                 max_index = (index > max_index) ? index : max_index;
                 break;
             case 'f':
                 ignore += fscanf(tracefile, "%u", &index);
-                trace->ops[op_index].type = FREE;
-                trace->ops[op_index].index = index;
+                trace->ops[op_index] = trace_op(FREE, index, 0);
                 break;
             default:
                 app_error("Bogus type character (%c) in tracefile %s\n",
@@ -1017,13 +1970,68 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+}
 
-    /* fill in the stats */
-    strcpy(stats->filename, trace->filename);
-    stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
-
-    return trace;
+/*
+ * map_trace - if trace->filename is a binary trace, map it read-only
+ *             and point trace at its header and ops.  Returns false,
+ *             leaving trace alone, if the file is a .rep file.
+ */
+static bool map_trace(trace_t *trace)
+{
+    trace_header_t hdr;
+    struct stat st;
+    traceop_t *op, *end;
+    unsigned type;
+    int32_t index;
+    void *map;
+    int fd;
+
+    if ((fd = open(trace->filename, O_RDONLY)) < 0)
+        unix_error("Could not open %s in read_trace", trace->filename);
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+        close(fd);
+        return false;
+    }
+    if (hdr.version != TRACE_VERSION)
+        app_error("%s: binary trace version %u, expected %u",
+                  trace->filename, hdr.version, TRACE_VERSION);
+    if (hdr.weight > 3u)
+        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+    if (hdr.num_ids > TRACE_MAX_IDS || hdr.num_ops > INT_MAX || hdr.num_huge > INT_MAX)
+        app_error("%s: too many ids or ops", trace->filename);
+    if (fstat(fd, &st) < 0)
+        unix_error("Could not stat %s in read_trace", trace->filename);
+    if ((size_t) st.st_size != sizeof(hdr) + (size_t) hdr.num_huge * sizeof(uint64_t) +
+        (size_t) hdr.num_ops * sizeof(traceop_t))
+        app_error("%s: %lld bytes, but the header promises %u ops",
+                  trace->filename, (long long) st.st_size, hdr.num_ops);
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        unix_error("Could not map %s in read_trace", trace->filename);
+    trace->map = map;
+    trace->map_len = st.st_size;
+    trace->weight = hdr.weight;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->data_bytes = hdr.data_bytes;
+    trace->huge = (uint64_t *)((char *) map + sizeof(hdr));
+    trace->num_huge = hdr.num_huge;
+    trace->ops = (traceop_t *)(trace->huge + hdr.num_huge);
+
+    /* The replay loops trust every index, so check them once here */
+    for (op = trace->ops, end = op + trace->num_ops; op < end; op++) {
+        type = trace_op_type(*op);
+        index = trace_op_index(*op);
+        if (type > REALLOC || index >= (int32_t) hdr.num_ids ||
+            (index < 0 && type != FREE) ||
+            (op->size >= TRACE_HUGE && op->size - TRACE_HUGE >= hdr.num_huge))
+            app_error("%s: bad request %ld", trace->filename, (long)(op - trace->ops));
+    }
+    return true;
 }
 
 /*
@@ -1038,12 +2046,17 @@ static void reinit_trace(trace_t *trace)
 
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated or mapped in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);
+    if (trace->map != NULL)   /* unmap the ops or free them... */
+        munmap(trace->map, trace->map_len);
+    else {
+        free(trace->ops);
+        free(trace->huge);
+    }
+    free(trace->blocks);      /* ... then the three arrays... */
     free(trace->block_sizes);
     free(trace->block_rand_base);
     free(trace);              /* and the trace record itself... */
@@ -1065,6 +2078,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     char *newp;
     char *oldp;
     char *p;
+    bool shrunk;
 
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
@@ -1079,8 +2093,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
     /* Interpret each operation in the trace in order */
     for (i = 0;  i < trace->num_ops;  i++) {
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+        index = trace_op_index(trace->ops[i]);
+        size = op_size(trace, i);
 
         if (debug_mode == DBG_EXPENSIVE) {
             range_t *r;
@@ -1100,7 +2114,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             }
         }
 
-        switch (trace->ops[i].type) {
+        switch (trace_op_type(trace->ops[i])) {
 
             case ALLOC: /* mm_malloc */
 
@@ -1154,14 +2168,18 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
 
                 /* Move the region from where it was.
-                 * Check up to min(size, oldsize) for correct copying. */
+                 * Check up to min(size, oldsize) for correct copying.
+                 * When the block grew, the data written at the end of the
+                 * old block must have survived too (the allocator may have
+                 * moved those pages rather than copied them), so only skip
+                 * the end check when the block shrank. */
+                shrunk = size < trace->block_sizes[index];
                 trace->blocks[index] = newp;
-                if (size < trace->block_sizes[index]) {
+                if (shrunk) {
                     trace->block_sizes[index] = size;
                 }
-                // NOTE: Might help to pass old size here to check bytes at each end of allocation
 
-                if (!check_index(trace, i, index, 1))
+                if (!check_index(trace, i, index, shrunk))
                     return false;
                 trace->block_sizes[index] = size;
 
@@ -1197,13 +2215,14 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace.  Extents the package maps for large blocks
+ *   count towards heapsize while they are mapped.  The package may
+ *   shrink its heap, so the peak heap size and the heap it keeps once
+ *   the trace is over are recorded in stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
     int i;
     int index;
@@ -1223,11 +2242,11 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
 
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+        switch (trace_op_type(trace->ops[i])) {
 
             case ALLOC: /* mm_alloc */
-                index = trace->ops[i].index;
-                size = trace->ops[i].size;
+                index = trace_op_index(trace->ops[i]);
+                size = op_size(trace, i);
 
                 if ((p = mm_malloc(size)) == NULL) {
                     app_error("trace %d: mm_malloc failed in eval_mm_util",
@@ -1242,8 +2261,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 break;
 
             case REALLOC: /* mm_realloc */
-                index = trace->ops[i].index;
-                newsize = trace->ops[i].size;
+                index = trace_op_index(trace->ops[i]);
+                newsize = op_size(trace, i);
                 oldsize = trace->block_sizes[index];
 
                 oldp = trace->blocks[index];
@@ -1260,7 +2279,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 break;
 
             case FREE: /* mm_free */
-                index = trace->ops[i].index;
+                index = trace_op_index(trace->ops[i]);
                 if (index < 0) {
                     size = 0;
                     p = 0;
@@ -1282,7 +2301,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
-        heap_size = mem_heapsize();
+        heap_size = mem_heapsize() + mem_mapsize();
         max_heap_size = (heap_size > max_heap_size) ?
             heap_size : max_heap_size;
     }
@@ -1291,6 +2310,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     printf(".");
 #endif
 
+    stats->peak_heap = max_heap_size;
+    stats->end_heap = heap_size;
     return ((double)max_total_size / (double)max_heap_size);
 }
 
@@ -1301,9 +2322,6 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
@@ -1312,40 +2330,190 @@ static void eval_mm_speed(void *ptr)
     if (!mm_init())
         app_error("mm_init failed in eval_mm_speed");
 
+    replay_mm(trace, trace->blocks);
+}
+
+/*
+ * replay_mm - Run every request of the trace through the mm package,
+ *             keeping the blocks in blocks[]
+ */
+static void replay_mm(trace_t *trace, char **blocks)
+{
+    replay_mm_ops(trace, blocks, 0, trace->num_ops);
+}
+
+/*
+ * replay_mm_ops - replay_mm for the requests first to last - 1
+ */
+static void replay_mm_ops(trace_t *trace, char **blocks, int first, int last)
+{
+    int i, index;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (i = first;  i < last;  i++)
+        switch (trace_op_type(trace->ops[i])) {
 
             case ALLOC: /* mm_malloc */
-                index = trace->ops[i].index;
-                size = trace->ops[i].size;
+                index = trace_op_index(trace->ops[i]);
+                size = op_size(trace, i);
                 if ((p = mm_malloc(size)) == NULL)
-                    app_error("mm_malloc error in eval_mm_speed");
-                trace->blocks[index] = p;
+                    app_error("mm_malloc error in replay_mm");
+                blocks[index] = p;
                 break;
 
             case REALLOC: /* mm_realloc */
-                index = trace->ops[i].index;
-                newsize = trace->ops[i].size;
-                oldp = trace->blocks[index];
+                index = trace_op_index(trace->ops[i]);
+                newsize = op_size(trace, i);
+                oldp = blocks[index];
                 if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
-                    app_error("mm_realloc error in eval_mm_speed");
-                trace->blocks[index] = newp;
+                    app_error("mm_realloc error in replay_mm");
+                blocks[index] = newp;
                 break;
 
             case FREE: /* mm_free */
-                index = trace->ops[i].index;
+                index = trace_op_index(trace->ops[i]);
                 if (index < 0) {
                     block = 0;
                 } else {
-                    block = trace->blocks[index];
+                    block = blocks[index];
                 }
                 mm_free(block);
                 break;
 
             default:
-                app_error("Nonexistent request type in eval_mm_speed");
+                app_error("Nonexistent request type in replay_mm");
+        }
+}
+
+static void *replay_mm_thread(void *ptr)
+{
+    thread_params_t *params = ptr;
+
+    replay_mm(params->trace, params->blocks);
+    return NULL;
+}
+
+/*
+ * eval_mm_threads - Replay the trace in nthreads threads at once, each
+ *                   with its own blocks, on a fresh heap.  Returns the
+ *                   total throughput in Kops/sec, best of MT_REPS runs.
+ */
+static double eval_mm_threads(trace_t *trace, int nthreads)
+{
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    thread_params_t *params = calloc(nthreads, sizeof(thread_params_t));
+    struct timespec start, end;
+    double secs, best = DBL_MAX;
+    int rep, t;
+
+    if (threads == NULL || params == NULL)
+        unix_error("calloc in eval_mm_threads failed");
+    for (t = 0; t < nthreads; t++) {
+        params[t].trace = trace;
+        params[t].blocks = calloc(trace->num_ids, sizeof(char *));
+        if (params[t].blocks == NULL)
+            unix_error("calloc in eval_mm_threads failed");
+    }
+    for (rep = 0; rep < MT_REPS; rep++) {
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in eval_mm_threads");
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (t = 0; t < nthreads; t++)
+            if (pthread_create(&threads[t], NULL, replay_mm_thread, &params[t]) != 0)
+                unix_error("pthread_create in eval_mm_threads failed");
+        for (t = 0; t < nthreads; t++)
+            pthread_join(threads[t], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        if (secs < best)
+            best = secs;
+    }
+    for (t = 0; t < nthreads; t++)
+        free(params[t].blocks);
+    free(params);
+    free(threads);
+    return (double)nthreads * trace->num_ops / best * 0.001;
+}
+
+static void *free_mm_thread(void *ptr)
+{
+    thread_params_t *params = ptr;
+    int i;
+
+    /* Let the mm package set the thread up before the clock starts */
+    mm_free(mm_malloc(1));
+    pthread_barrier_wait(params->barrier);
+    clock_gettime(CLOCK_MONOTONIC, &params->start);
+    for (i = params->first; i < params->num_blocks; i += params->stride)
+        mm_free(params->blocks[i]);
+    clock_gettime(CLOCK_MONOTONIC, &params->end);
+    return NULL;
+}
+
+/*
+ * eval_mm_remote - The main thread allocates a block for the alloc
+ *                  requests of the trace, as many as fit in its peak
+ *                  data size, then nthreads other threads free them
+ *                  all at once, each taking every nthreads-th block.
+ *                  Only the frees are timed, from the first thread
+ *                  starting them to the last one done, so creating the
+ *                  threads and their exit do not count.  Returns the
+ *                  total rate of frees in Kops/sec, best of MT_REPS runs.
+ */
+static double eval_mm_remote(trace_t *trace, int nthreads)
+{
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    thread_params_t *params = calloc(nthreads, sizeof(thread_params_t));
+    char **blocks = calloc(trace->num_ops, sizeof(char *));
+    pthread_barrier_t barrier;
+    double start, end, secs, best = DBL_MAX;
+    size_t bytes;
+    int i, n, rep, t;
+
+    if (threads == NULL || params == NULL || blocks == NULL)
+        unix_error("calloc in eval_mm_remote failed");
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_remote");
+    for (rep = 0; rep < MT_REPS; rep++) {
+        for (i = n = 0, bytes = 0; i < trace->num_ops; i++) {
+            if (trace_op_type(trace->ops[i]) != ALLOC || op_size(trace, i) == 0)
+                continue;
+            if ((bytes += op_size(trace, i)) > trace->data_bytes)
+                break;
+            if ((blocks[n++] = mm_malloc(op_size(trace, i))) == NULL)
+                app_error("mm_malloc error in eval_mm_remote");
         }
+        pthread_barrier_init(&barrier, NULL, nthreads);
+        for (t = 0; t < nthreads; t++) {
+            params[t].trace = trace;
+            params[t].blocks = blocks;
+            params[t].first = t;
+            params[t].stride = nthreads;
+            params[t].num_blocks = n;
+            params[t].barrier = &barrier;
+            if (pthread_create(&threads[t], NULL, free_mm_thread, &params[t]) != 0)
+                unix_error("pthread_create in eval_mm_remote failed");
+        }
+        start = DBL_MAX;
+        end = 0;
+        for (t = 0; t < nthreads; t++) {
+            pthread_join(threads[t], NULL);
+            start = fmin(start, params[t].start.tv_sec + params[t].start.tv_nsec * 1e-9);
+            end = fmax(end, params[t].end.tv_sec + params[t].end.tv_nsec * 1e-9);
+        }
+        pthread_barrier_destroy(&barrier);
+        secs = end - start;
+        if (secs < best)
+            best = secs;
+    }
+    free(blocks);
+    free(params);
+    free(threads);
+    return n / best * 0.001;
 }
 
 /*
@@ -1363,29 +2531,29 @@ static bool eval_libc_valid(trace_t *trace)
     reinit_trace(trace);
 
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+        switch (trace_op_type(trace->ops[i])) {
 
             case ALLOC: /* malloc */
-                if ((p = malloc(trace->ops[i].size)) == NULL) {
+                if ((p = malloc(op_size(trace, i))) == NULL) {
                     malloc_error(trace, i, "libc malloc failed");
                     unix_error("System message");
                 }
-                trace->blocks[trace->ops[i].index] = p;
+                trace->blocks[trace_op_index(trace->ops[i])] = p;
                 break;
 
             case REALLOC: /* realloc */
-                newsize = trace->ops[i].size;
-                oldp = trace->blocks[trace->ops[i].index];
+                newsize = op_size(trace, i);
+                oldp = trace->blocks[trace_op_index(trace->ops[i])];
                 if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
                     malloc_error(trace, i, "libc realloc failed");
                     unix_error("System message");
                 }
-                trace->blocks[trace->ops[i].index] = newp;
+                trace->blocks[trace_op_index(trace->ops[i])] = newp;
                 break;
 
             case FREE: /* free */
-                if (trace->ops[i].index >= 0) {
-                    free(trace->blocks[trace->ops[i].index]);
+                if (trace_op_index(trace->ops[i]) >= 0) {
+                    free(trace->blocks[trace_op_index(trace->ops[i])]);
                 } else {
                     free(0);
                 }
@@ -1415,18 +2583,18 @@ static void eval_libc_speed(void *ptr)
     reinit_trace(trace);
 
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+        switch (trace_op_type(trace->ops[i])) {
             case ALLOC: /* malloc */
-                index = trace->ops[i].index;
-                size = trace->ops[i].size;
+                index = trace_op_index(trace->ops[i]);
+                size = op_size(trace, i);
                 if ((p = malloc(size)) == NULL)
                     unix_error("malloc failed in eval_libc_speed");
                 trace->blocks[index] = p;
                 break;
 
             case REALLOC: /* realloc */
-                index = trace->ops[i].index;
-                newsize = trace->ops[i].size;
+                index = trace_op_index(trace->ops[i]);
+                newsize = op_size(trace, i);
                 oldp = trace->blocks[index];
                 if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
                     unix_error("realloc failed in eval_libc_speed\n");
@@ -1435,7 +2603,7 @@ static void eval_libc_speed(void *ptr)
                 break;
 
             case FREE: /* free */
-                index = trace->ops[i].index;
+                index = trace_op_index(trace->ops[i]);
                 if (index >= 0) {
                     block = trace->blocks[index];
                     free(block);
@@ -1452,6 +2620,27 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * printheap - prints the peak heap of each valid trace and the heap the
+ *             package kept after it, once the burst was over
+ */
+static void printheap(int n, stats_t *stats)
+{
+    int i;
+
+    printf("Heap for mm malloc:\n");
+    printf("%10s%12s%8s  %s\n", "peak KB", "retained KB", "kept", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        printf("%10.0f%12.0f%7.1f%%  %s\n", stats[i].peak_heap / 1024.0,
+               stats[i].end_heap / 1024.0,
+               stats[i].peak_heap > 0 ? 100.0 * stats[i].end_heap / stats[i].peak_heap : 0.0,
+               stats[i].filename);
+    }
+    printf("\n");
+}
+
 /*
  * printresults - prints a performance summary for some malloc package and returns
  *                a summary of the stats to the caller. 
@@ -1840,5 +3029,15 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-P <n>     Also replay each trace in 1, 2, 4, ... n threads at once.\n");
+    fprintf(stderr, "\t-R <n>     Also free each trace's blocks from 1, 2, 4, ... n other threads.\n");
+    fprintf(stderr, "\t-X <n>     Also compare per-thread and per-CPU caches in n threads.\n");
+    fprintf(stderr, "\t-C         Use per-CPU caches.\n");
+    fprintf(stderr, "\t-M <n>     Also report heap, resident memory and page faults at n points of each trace.\n");
+    fprintf(stderr, "\t-S <file>  Stream <file>, or - for stdin, through one replay instead of the tests.\n");
+    fprintf(stderr, "\t-H         Ask for transparent huge pages for the heap.\n");
+    fprintf(stderr, "\t-F <kb>    Prefault the heap in <kb> KB chunks as it grows (0 for 2048).\n");
+    fprintf(stderr, "\t-j <n>     Check up to n traces at once, each in a process of its own.\n");
+    fprintf(stderr, "\t-p <cpus>  Time traces in processes pinned to <cpus>, such as 2,3 or 4-7.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
@@ -0,0 +1,173 @@
+/*
+ * membench - checks mm_memcpy and mm_memset at each instruction set
+ * level the CPU has, then times them against libc from 1 byte to
+ * 64 MB.
+ *
+ * Usage: membench [-h] [-a <offset>] [-m <bytes>]
+ *
+ * Sizes go up by powers of two, with a size halfway between each pair
+ * so that the overlapping head and tail stores get timed too.  Times
+ * are the best of fsec's samples, reported in GB/s of bytes written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "memlib.h"
+#include "fcyc.h"
+
+#define MAX_SIZE (64 * 1024 * 1024) /* Largest size timed by default */
+#define CHECK_SIZE 1024             /* Every size up to here is checked */
+#define LEVELS (MEM_SIMD_BEST + 1)
+
+static const char *level_names[LEVELS] = { "words", "sse2", "avx2", "avx512" };
+
+/* What one timed call does */
+typedef struct {
+    void *(*copy)(void *dst, const void *src, size_t n);
+    void *(*set)(void *dst, int c, size_t n);
+    unsigned char *dst;
+    unsigned char *src;
+    size_t size;
+} bench_t;
+
+static void run_copy(void *ptr) {
+    bench_t *b = ptr;
+    b->copy(b->dst, b->src, b->size);
+}
+
+static void run_set(void *ptr) {
+    bench_t *b = ptr;
+    b->set(b->dst, 0x5a, b->size);
+}
+
+/*
+ * check - compare mm_memcpy and mm_memset with libc for every size up
+ *         to CHECK_SIZE and a few far past it, at every alignment of
+ *         the destination in a 64-byte line.  Returns the errors found.
+ */
+static int check(const char *name, unsigned char *dst, unsigned char *src,
+                 unsigned char *want) {
+    static const size_t big[] = { 4095, 65537, 1 << 20, (5 << 20) + 3 };
+    size_t sizes = CHECK_SIZE + sizeof(big) / sizeof(big[0]);
+    size_t i, n, off;
+    int errors = 0;
+
+    for (i = 0; i < sizes; i++) {
+        n = i < CHECK_SIZE ? i : big[i - CHECK_SIZE];
+        for (off = 0; off < 64; off += (n < CHECK_SIZE ? 1 : 7)) {
+            /* Bytes around the destination must be left alone */
+            memset(dst, 0xee, n + 128);
+            memset(want, 0xee, n + 128);
+            memcpy(want + off, src + 3, n);
+            mm_memcpy(dst + off, src + 3, n);
+            if (memcmp(dst, want, n + 128) != 0) {
+                if (errors++ < 10)
+                    fprintf(stderr, "%s: mm_memcpy wrong for %zu bytes at offset %zu\n",
+                            name, n, off);
+            }
+            memset(want + off, (int) n, n);
+            mm_memset(dst + off, (int) n, n);
+            if (memcmp(dst, want, n + 128) != 0) {
+                if (errors++ < 10)
+                    fprintf(stderr, "%s: mm_memset wrong for %zu bytes at offset %zu\n",
+                            name, n, off);
+            }
+        }
+    }
+    return errors;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-h] [-a <offset>] [-m <bytes>]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <offset>  Misalign the destination by <offset> bytes.\n");
+    fprintf(stderr, "\t-m <bytes>   Largest size to time (default 64 MB).\n");
+    fprintf(stderr, "\t-h           Print this message.\n");
+}
+
+int main(int argc, char **argv) {
+    size_t max_size = MAX_SIZE;
+    size_t offset = 0;
+    size_t size, step, buf_size;
+    unsigned char *dst, *src, *want;
+    bench_t b;
+    int best, level, c, errors = 0;
+
+    while ((c = getopt(argc, argv, "a:m:h")) != EOF) {
+        switch (c) {
+            case 'a':
+                offset = strtoul(optarg, NULL, 0) % 64;
+                break;
+            case 'm':
+                max_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (max_size < 1)
+        max_size = 1;
+
+    /* Room for the largest checked or timed size, misaligned, with a margin */
+    buf_size = (max_size > (8 << 20) ? max_size : (8 << 20)) + 192;
+    if (posix_memalign((void **) &dst, 64, buf_size) != 0 ||
+        posix_memalign((void **) &src, 64, buf_size) != 0 ||
+        posix_memalign((void **) &want, 64, buf_size) != 0) {
+        fprintf(stderr, "membench: out of memory\n");
+        exit(1);
+    }
+    for (size = 0; size < buf_size; size++)
+        src[size] = (unsigned char)(size * 131 + 7);
+
+    best = mem_simd_select(MEM_SIMD_BEST);
+    for (level = MEM_SIMD_NONE; level <= best; level++) {
+        mem_simd_select(level);
+        errors += check(level_names[level], dst, src, want);
+    }
+    if (errors) {
+        fprintf(stderr, "membench: %d errors\n", errors);
+        exit(1);
+    }
+    printf("mm_memcpy and mm_memset agree with libc at every level up to %s\n",
+           level_names[best]);
+
+    b.dst = dst + offset;
+    b.src = src;
+    printf("\n%10s %6s %8s", "bytes", "op", "libc");
+    for (level = MEM_SIMD_NONE; level <= best; level++)
+        printf(" %8s", level_names[level]);
+    printf("   (GB/s)\n");
+    for (step = 1; step <= max_size; step *= 2) {
+        size_t sizes[2] = { step, step + step / 2 };
+        int k;
+
+        for (k = 0; k < 2; k++) {
+            if ((size = sizes[k]) > max_size || (k == 1 && step < 2))
+                continue;
+            b.size = size;
+            for (c = 0; c < 2; c++) {
+                printf("%10zu %6s", size, c == 0 ? "copy" : "set");
+                b.copy = memcpy;
+                b.set = memset;
+                printf(" %8.2f", size / fsec(c == 0 ? run_copy : run_set, &b) / 1e9);
+                b.copy = mm_memcpy;
+                b.set = mm_memset;
+                for (level = MEM_SIMD_NONE; level <= best; level++) {
+                    mem_simd_select(level);
+                    printf(" %8.2f", size / fsec(c == 0 ? run_copy : run_set, &b) / 1e9);
+                }
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+    mem_simd_select(MEM_SIMD_BEST);
+    return 0;
+}
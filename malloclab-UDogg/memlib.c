@@ -3,7 +3,35 @@
  * because it allows us to interleave calls from the student's malloc
  * package with the system's malloc package in libc.
  *
+ * Memory comes in regions, each a reservation of its own with its own
+ * break and limit, so that a multi-arena allocator can grow its arenas
+ * independently and harnesses or tests can keep heaps of their own
+ * without touching anyone else's.  Every region starts on a
+ * REGION_SIZE boundary and is numbered by a small table indexed by
+ * address / REGION_SIZE, so mm_arena_of is a shift and a load.
+ * mem_init makes the heap: regions 0 to MAX_ARENAS - 1, which the
+ * mm_arena routines call arenas.  Arena 0 is the heap that mm_sbrk,
+ * mm_heap_lo and mm_heap_hi describe.  Each region's break should only
+ * be moved by one thread at a time.
+ *
+ * Apart from the regions, mm_map hands out page-aligned extents that
+ * are mapped on their own and unmapped by mm_unmap, for blocks too big
+ * to be worth keeping in a heap that never shrinks.  memlib keeps a
+ * list of them so that the driver can count and check them.  Each
+ * extent belongs to a region, arena 0 unless mm_arena_map names
+ * another, and goes when that region is reset or destroyed.
+ *
+ * mm_purge gives the pages inside a free block back to the system
+ * while the block stays in the heap, and mem_resident tells the driver
+ * how much of the heap is still backed by memory.
+ *
+ * mem_set_policy picks how the heap meets the page tables: regions and
+ * extents can be marked for transparent huge pages, and each growth
+ * of a region's break can be faulted in ahead, a chunk at a time, so
+ * that first touches land in mem_sbrk rather than in the allocator.
+ * Extents are never prefaulted.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,60 +42,134 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "memlib.h"
 #include "config.h"
 
+#define REGION_SIZE (MAX_HEAP_SIZE / MAX_ARENAS) /* most bytes a region can hold */
+#define SLOT_COUNT ((1ull << 47) / REGION_SIZE)  /* REGION_SIZE slots in the user address space */
+#define NT_THRESHOLD (4 * 1024 * 1024)           /* non-temporal stores from here if the LLC size is unknown */
+
+/*
+ * A region: its first byte, its current break, the end of the pages
+ * prefaulted for it, the number of bytes it may grow to and its id,
+ * the index in regions[].  lo is NULL while the id is free.
+ */
+struct mem_region {
+    unsigned char *lo;
+    unsigned char *brk;
+    unsigned char *faulted;     /* Pages below here are faulted in */
+    size_t limit;
+    int id;
+};
+
 /* private global variables */
-static unsigned char *heap;                 /* Starting address of heap */
-static unsigned char *mem_brk;              /* Current position of break */
-static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static mem_region_t regions[MAX_REGIONS];       /* Every region, by id */
+static unsigned char region_slots[SLOT_COUNT];  /* Id + 1 of the region in each slot, or 0 */
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER; /* Serializes create and destroy */
+
+/* A mapped extent: its first byte, its length and the region it belongs to */
+typedef struct {
+    unsigned char *lo;
+    size_t len;
+    int owner;
+} extent_t;
+
+static extent_t *extents;      /* Every mapped extent, in no order */
+static size_t extent_count;    /* Number of extents */
+static size_t extent_max;      /* Room in extents[] */
+static size_t map_bytes;       /* Bytes in all extents */
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards the extent list */
+static size_t purge_bytes;     /* Bytes given back by mm_purge */
+static int page_policy;        /* MEM_HUGEPAGES and MEM_PREFAULT bits */
+static size_t prefault_chunk = MEM_PREFAULT_CHUNK; /* Bytes faulted in at a time */
 
 /* 
  * mm_sbrk - simple model of the sbrk function. Extends the heap 
  *           by incr bytes and returns the start address of the
- *           new area. In this model, the heap cannot be shrunk.
+ *           new area.  A negative incr shrinks the heap and gives the
+ *           whole pages past the new break back to the system; they
+ *           read as zeros if the heap grows over them again.
  */
 void *mm_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
+    return mem_region_sbrk(&regions[0], incr);
+}
 
-    bool ok = true;
-    if (incr < 0) {
-	ok = false;
-	fprintf(stderr, "ERROR: mm_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
-	ok = false;
-	long alloc = mem_brk - heap + incr;
-	fprintf(stderr, "ERROR: mm_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
-    }
-    if (ok) {
-	mem_brk += incr;
-	return (void *) old_brk;
-    } else {
-	errno = ENOMEM;
-	return (void *) -1;
-    }
+/*
+ * mm_arena_sbrk - mm_sbrk for arena region arena
+ */
+void *mm_arena_sbrk(int arena, intptr_t incr) {
+    return mem_region_sbrk(&regions[arena], incr);
 }
 
 /*
  * mm_heap_lo - return address of the first heap byte
  */
 void *mm_heap_lo(){
-    return (void *) heap;
+    return (void *) regions[0].lo;
 }
 
 /* 
  * mm_heap_hi - return address of last heap byte
  */
 void *mm_heap_hi(){
-    return (void *)(mem_brk - 1);
+    return (void *)(regions[0].brk - 1);
+}
+
+/*
+ * mm_arena_lo - return address of the first byte of arena region
+ *               arena, or NULL if there is no such region
+ */
+void *mm_arena_lo(int arena){
+    if (arena < 0 || arena >= MAX_REGIONS)
+	return NULL;
+    return (void *) regions[arena].lo;
 }
 
 /*
- * mm_heapsize - returns the heap size in bytes
+ * mm_arena_hi - return address of the last byte in use in arena region arena
+ */
+void *mm_arena_hi(int arena){
+    return (void *)(regions[arena].brk - 1);
+}
+
+/*
+ * mm_arena_of - returns the arena region that p lies in, or -1
+ */
+int mm_arena_of(const void *p){
+    const unsigned char *c = p;
+    uintptr_t slot = (uintptr_t) c / REGION_SIZE;
+    int id;
+
+    if (slot >= SLOT_COUNT || (id = region_slots[slot] - 1) < 0)
+	return -1;
+    if (c >= regions[id].lo + regions[id].limit)
+	return -1;
+    return id;
+}
+
+/*
+ * mm_arena_count - returns the number of arena regions of the heap
+ */
+int mm_arena_count(){
+    return MAX_ARENAS;
+}
+
+/*
+ * mm_heapsize - returns the heap size in bytes, summed over all arenas
  */
 size_t mm_heapsize() {
-    return (size_t)(mem_brk - heap);
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < MAX_ARENAS; i++)
+	size += mem_region_size(&regions[i]);
+    return size;
 }
 
 /*
@@ -78,9 +180,32 @@ size_t mm_pagesize(){
 }
 
 /*
- * mm_memcpy - copies n bytes from src to dst
+ * mm_memcpy and mm_memset go through a pointer that the first mem_init
+ * sets to the widest version the CPU and OS support: AVX-512, AVX2 or
+ * SSE2, or the word-at-a-time loops elsewhere.  Until then they use the
+ * word-at-a-time loops.  Choosing once, before any thread can call them,
+ * keeps the pointers and nt_threshold free of races; mem_simd_select
+ * may only be called from single-threaded setup, and then mem_init
+ * keeps its choice.  Each vector version stores a
+ * possibly unaligned first and last vector, which overlap the aligned
+ * main loop in between, so only blocks under 16 bytes need scalar
+ * stores.  At nt_threshold bytes and up the main loop uses
+ * non-temporal stores, so that copying a block bigger than the cache
+ * does not evict the rest of the heap.
  */
-void *mm_memcpy(void *dst, const void *src, size_t n) {
+
+static void *copy_words(void *dst, const void *src, size_t n);
+static void *set_words(void *dst, int c, size_t n);
+
+static void *(*memcpy_impl)(void *, const void *, size_t) = copy_words;
+static void *(*memset_impl)(void *, int, size_t) = set_words;
+static size_t nt_threshold = NT_THRESHOLD; /* Bytes from which stores bypass the cache */
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT; /* Done once anything is chosen */
+
+/*
+ * copy_words - copies n bytes from src to dst a word at a time
+ */
+static void *copy_words(void *dst, const void *src, size_t n) {
     void *savedst = dst;
     size_t w = sizeof(uint64_t);
     while (n >= w) {
@@ -98,9 +223,9 @@ void *mm_memcpy(void *dst, const void *src, size_t n) {
 }
 
 /*
- * mm_memset - sets the first n bytes of memory pointed to by dst to c
+ * set_words - sets n bytes at dst to c a word at a time
  */
-void *mm_memset(void *dst, int c, size_t n) {
+static void *set_words(void *dst, int c, size_t n) {
     void *savedst = dst;
     uint64_t byte = c & 0xFF;
     uint64_t data = 0;
@@ -120,42 +245,813 @@ void *mm_memset(void *dst, int c, size_t n) {
     return savedst;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * copy_small - copies n < 16 bytes with two overlapping loads and
+ *              stores of the largest power of two that fits
+ */
+static inline void copy_small(unsigned char *d, const unsigned char *s, size_t n) {
+    if (n >= 8) {
+	uint64_t a, b;
+	memcpy(&a, s, 8);
+	memcpy(&b, s + n - 8, 8);
+	memcpy(d, &a, 8);
+	memcpy(d + n - 8, &b, 8);
+    } else if (n >= 4) {
+	uint32_t a, b;
+	memcpy(&a, s, 4);
+	memcpy(&b, s + n - 4, 4);
+	memcpy(d, &a, 4);
+	memcpy(d + n - 4, &b, 4);
+    } else if (n >= 2) {
+	uint16_t a, b;
+	memcpy(&a, s, 2);
+	memcpy(&b, s + n - 2, 2);
+	memcpy(d, &a, 2);
+	memcpy(d + n - 2, &b, 2);
+    } else if (n == 1) {
+	*d = *s;
+    }
+}
+
+/*
+ * set_small - sets n < 16 bytes at d to the byte repeated in data,
+ *             the same way
+ */
+static inline void set_small(unsigned char *d, uint64_t data, size_t n) {
+    if (n >= 8) {
+	memcpy(d, &data, 8);
+	memcpy(d + n - 8, &data, 8);
+    } else if (n >= 4) {
+	memcpy(d, &data, 4);
+	memcpy(d + n - 4, &data, 4);
+    } else if (n >= 2) {
+	memcpy(d, &data, 2);
+	memcpy(d + n - 2, &data, 2);
+    } else if (n == 1) {
+	*d = (unsigned char) data;
+    }
+}
+
+static void *copy_sse2(void *dst, const void *src, size_t n) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    unsigned char *end;
+    __m128i head, tail;
+    size_t skip;
+
+    if (n < 16) {
+	copy_small(d, s, n);
+	return dst;
+    }
+    head = _mm_loadu_si128((const __m128i *) s);
+    tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+    if (n > 32) {
+	/* Cover [d + skip, end) with aligned stores; head and tail do the rest */
+	end = d + n - 16;
+	skip = 16 - ((uintptr_t) d & 15);
+	s += skip;
+	if (n >= nt_threshold) {
+	    for (d += skip; d < end; d += 16, s += 16)
+		_mm_stream_si128((__m128i *) d, _mm_loadu_si128((const __m128i *) s));
+	    _mm_sfence();
+	} else {
+	    for (d += skip; d + 48 < end; d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *) s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_store_si128((__m128i *) d, a);
+		_mm_store_si128((__m128i *)(d + 16), b);
+		_mm_store_si128((__m128i *)(d + 32), c);
+		_mm_store_si128((__m128i *)(d + 48), e);
+	    }
+	    for (; d < end; d += 16, s += 16)
+		_mm_store_si128((__m128i *) d, _mm_loadu_si128((const __m128i *) s));
+	}
+	d = dst;
+    }
+    _mm_storeu_si128((__m128i *) d, head);
+    _mm_storeu_si128((__m128i *)(d + n - 16), tail);
+    return dst;
+}
+
+static void *set_sse2(void *dst, int c, size_t n) {
+    unsigned char *d = dst;
+    unsigned char *end;
+    __m128i v = _mm_set1_epi8((char) c);
+
+    if (n < 16) {
+	set_small(d, (c & 0xFF) * 0x0101010101010101ull, n);
+	return dst;
+    }
+    _mm_storeu_si128((__m128i *) d, v);
+    _mm_storeu_si128((__m128i *)(d + n - 16), v);
+    if (n > 32) {
+	end = d + n - 16;
+	d += 16 - ((uintptr_t) d & 15);
+	if (n >= nt_threshold) {
+	    for (; d < end; d += 16)
+		_mm_stream_si128((__m128i *) d, v);
+	    _mm_sfence();
+	} else {
+	    for (; d + 48 < end; d += 64) {
+		_mm_store_si128((__m128i *) d, v);
+		_mm_store_si128((__m128i *)(d + 16), v);
+		_mm_store_si128((__m128i *)(d + 32), v);
+		_mm_store_si128((__m128i *)(d + 48), v);
+	    }
+	    for (; d < end; d += 16)
+		_mm_store_si128((__m128i *) d, v);
+	}
+    }
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static void *copy_avx2(void *dst, const void *src, size_t n) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    unsigned char *end;
+    __m256i head, tail;
+    size_t skip;
+
+    if (n < 16) {
+	copy_small(d, s, n);
+	return dst;
+    }
+    if (n < 32) {
+	__m128i a = _mm_loadu_si128((const __m128i *) s);
+	__m128i b = _mm_loadu_si128((const __m128i *)(s + n - 16));
+	_mm_storeu_si128((__m128i *) d, a);
+	_mm_storeu_si128((__m128i *)(d + n - 16), b);
+	return dst;
+    }
+    head = _mm256_loadu_si256((const __m256i *) s);
+    tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+    if (n > 64) {
+	end = d + n - 32;
+	skip = 32 - ((uintptr_t) d & 31);
+	s += skip;
+	if (n >= nt_threshold) {
+	    for (d += skip; d < end; d += 32, s += 32)
+		_mm256_stream_si256((__m256i *) d, _mm256_loadu_si256((const __m256i *) s));
+	    _mm_sfence();
+	} else {
+	    for (d += skip; d + 96 < end; d += 128, s += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) s);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		__m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_store_si256((__m256i *) d, a);
+		_mm256_store_si256((__m256i *)(d + 32), b);
+		_mm256_store_si256((__m256i *)(d + 64), c);
+		_mm256_store_si256((__m256i *)(d + 96), e);
+	    }
+	    for (; d < end; d += 32, s += 32)
+		_mm256_store_si256((__m256i *) d, _mm256_loadu_si256((const __m256i *) s));
+	}
+	d = dst;
+    }
+    _mm256_storeu_si256((__m256i *) d, head);
+    _mm256_storeu_si256((__m256i *)(d + n - 32), tail);
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static void *set_avx2(void *dst, int c, size_t n) {
+    unsigned char *d = dst;
+    unsigned char *end;
+    __m256i v;
+
+    if (n < 16) {
+	set_small(d, (c & 0xFF) * 0x0101010101010101ull, n);
+	return dst;
+    }
+    if (n < 32) {
+	__m128i x = _mm_set1_epi8((char) c);
+	_mm_storeu_si128((__m128i *) d, x);
+	_mm_storeu_si128((__m128i *)(d + n - 16), x);
+	return dst;
+    }
+    v = _mm256_set1_epi8((char) c);
+    _mm256_storeu_si256((__m256i *) d, v);
+    _mm256_storeu_si256((__m256i *)(d + n - 32), v);
+    if (n > 64) {
+	end = d + n - 32;
+	d += 32 - ((uintptr_t) d & 31);
+	if (n >= nt_threshold) {
+	    for (; d < end; d += 32)
+		_mm256_stream_si256((__m256i *) d, v);
+	    _mm_sfence();
+	} else {
+	    for (; d + 96 < end; d += 128) {
+		_mm256_store_si256((__m256i *) d, v);
+		_mm256_store_si256((__m256i *)(d + 32), v);
+		_mm256_store_si256((__m256i *)(d + 64), v);
+		_mm256_store_si256((__m256i *)(d + 96), v);
+	    }
+	    for (; d < end; d += 32)
+		_mm256_store_si256((__m256i *) d, v);
+	}
+    }
+    return dst;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void *copy_avx512(void *dst, const void *src, size_t n) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    unsigned char *end;
+    __m512i head, tail;
+    size_t skip;
+
+    if (n < 32)
+	return copy_avx2(dst, src, n);
+    if (n < 64) {
+	__m256i a = _mm256_loadu_si256((const __m256i *) s);
+	__m256i b = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+	_mm256_storeu_si256((__m256i *) d, a);
+	_mm256_storeu_si256((__m256i *)(d + n - 32), b);
+	return dst;
+    }
+    head = _mm512_loadu_si512(s);
+    tail = _mm512_loadu_si512(s + n - 64);
+    if (n > 128) {
+	end = d + n - 64;
+	skip = 64 - ((uintptr_t) d & 63);
+	s += skip;
+	if (n >= nt_threshold) {
+	    for (d += skip; d < end; d += 64, s += 64)
+		_mm512_stream_si512((void *) d, _mm512_loadu_si512(s));
+	    _mm_sfence();
+	} else {
+	    for (d += skip; d + 192 < end; d += 256, s += 256) {
+		__m512i a = _mm512_loadu_si512(s);
+		__m512i b = _mm512_loadu_si512(s + 64);
+		__m512i c = _mm512_loadu_si512(s + 128);
+		__m512i e = _mm512_loadu_si512(s + 192);
+		_mm512_store_si512(d, a);
+		_mm512_store_si512(d + 64, b);
+		_mm512_store_si512(d + 128, c);
+		_mm512_store_si512(d + 192, e);
+	    }
+	    for (; d < end; d += 64, s += 64)
+		_mm512_store_si512(d, _mm512_loadu_si512(s));
+	}
+	d = dst;
+    }
+    _mm512_storeu_si512(d, head);
+    _mm512_storeu_si512(d + n - 64, tail);
+    return dst;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void *set_avx512(void *dst, int c, size_t n) {
+    unsigned char *d = dst;
+    unsigned char *end;
+    __m512i v;
+
+    if (n < 32)
+	return set_avx2(dst, c, n);
+    if (n < 64) {
+	__m256i y = _mm256_set1_epi8((char) c);
+	_mm256_storeu_si256((__m256i *) d, y);
+	_mm256_storeu_si256((__m256i *)(d + n - 32), y);
+	return dst;
+    }
+    v = _mm512_set1_epi8((char) c);
+    _mm512_storeu_si512(d, v);
+    _mm512_storeu_si512(d + n - 64, v);
+    if (n > 128) {
+	end = d + n - 64;
+	d += 64 - ((uintptr_t) d & 63);
+	if (n >= nt_threshold) {
+	    for (; d < end; d += 64)
+		_mm512_stream_si512((void *) d, v);
+	    _mm_sfence();
+	} else {
+	    for (; d + 192 < end; d += 256) {
+		_mm512_store_si512(d, v);
+		_mm512_store_si512(d + 64, v);
+		_mm512_store_si512(d + 128, v);
+		_mm512_store_si512(d + 192, v);
+	    }
+	    for (; d < end; d += 64)
+		_mm512_store_si512(d, v);
+	}
+    }
+    return dst;
+}
+
+#endif /* x86 */
+
+/*
+ * simd_select - mem_simd_select, without marking the choice as made
+ */
+static int simd_select(int level) {
+    int best = MEM_SIMD_NONE;
+    long llc;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+	best = MEM_SIMD_AVX512;
+    else if (__builtin_cpu_supports("avx2"))
+	best = MEM_SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+	best = MEM_SIMD_SSE2;
+#endif
+    if (level > best)
+	level = best;
+    /* Stores bypass the cache for blocks bigger than most of the LLC */
+    if ((llc = sysconf(_SC_LEVEL3_CACHE_SIZE)) > 0)
+	nt_threshold = (size_t) llc / 4 * 3;
+    switch (level) {
+#if defined(__x86_64__) || defined(__i386__)
+    case MEM_SIMD_AVX512:
+	memcpy_impl = copy_avx512;
+	memset_impl = set_avx512;
+	break;
+    case MEM_SIMD_AVX2:
+	memcpy_impl = copy_avx2;
+	memset_impl = set_avx2;
+	break;
+    case MEM_SIMD_SSE2:
+	memcpy_impl = copy_sse2;
+	memset_impl = set_sse2;
+	break;
+#endif
+    default:
+	level = MEM_SIMD_NONE;
+	memcpy_impl = copy_words;
+	memset_impl = set_words;
+	break;
+    }
+    return level;
+}
+
+/* Run once through simd_once: keep an explicit choice, or make the best */
+static void simd_keep(void) {
+}
+
+static void simd_best(void) {
+    simd_select(MEM_SIMD_BEST);
+}
+
+/*
+ * mem_simd_select - make mm_memcpy and mm_memset use level, one of the
+ *                   MEM_SIMD levels, or the widest the CPU supports if
+ *                   the CPU lacks level.  Returns the level chosen.
+ *                   No other thread may be using memlib.
+ */
+int mem_simd_select(int level) {
+    pthread_once(&simd_once, simd_keep);
+    return simd_select(level);
+}
+
+/*
+ * mm_memcpy - copies n bytes from src to dst
+ */
+void *mm_memcpy(void *dst, const void *src, size_t n) {
+    return memcpy_impl(dst, src, n);
+}
+
+/*
+ * mm_memset - sets the first n bytes of memory pointed to by dst to c
+ */
+void *mm_memset(void *dst, int c, size_t n) {
+    return memset_impl(dst, c, n);
+}
+
+/*
+ * mm_remap - moves the len bytes of pages at src to dst without copying
+ *            them, by remapping the pages.  src, dst and len must be
+ *            multiples of the page size, both ranges must lie inside
+ *            the same arena, and they must not overlap.  Afterwards src reads
+ *            as zeros.  Returns dst, or NULL if the pages could not be
+ *            moved (the heap is unchanged and the caller should copy).
+ */
+void *mm_remap(void *dst, void *src, size_t len) {
+    uintptr_t mask = mm_pagesize() - 1;
+    unsigned char *d = dst;
+    unsigned char *s = src;
+    int arena = mm_arena_of(s);
+
+    if ((((uintptr_t) d | (uintptr_t) s | len) & mask) != 0 || len == 0)
+	return NULL;
+    if (arena < 0 || mm_arena_of(d) != arena)
+	return NULL;
+    if (s + len > regions[arena].brk || d + len > regions[arena].brk)
+	return NULL;
+    if (s < d + len && d < s + len)
+	return NULL;
+    if (mremap(s, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, d) == MAP_FAILED)
+	return NULL;
+    /* Fill the hole left at src so that the heap stays contiguous */
+    if (mmap(s, len, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+	     -1, 0) == MAP_FAILED) {
+	fprintf(stderr, "FAILURE.  mmap couldn't refill heap at %p after mm_remap\n", s);
+	exit(1);
+    }
+    return dst;
+}
+
+/*
+ * prefault - fault in the pages from lo for len bytes, both page
+ *            aligned, which nothing has written yet
+ */
+static void prefault(unsigned char *lo, size_t len) {
+    size_t pagesize = mm_pagesize();
+    size_t off;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(lo, len, MADV_POPULATE_WRITE) == 0)
+	return;
+#endif
+    /* Kernels before 5.14 lack MADV_POPULATE_WRITE; touch each page */
+    for (off = 0; off < len; off += pagesize)
+	((volatile unsigned char *) lo)[off] = 0;
+}
+
+/*
+ * mm_map - map a new extent of len bytes, rounded up to whole pages,
+ *          for arena 0.  It reads as zeros.  Returns NULL if it cannot
+ *          be mapped.
+ */
+void *mm_map(size_t len) {
+    return mm_arena_map(0, len);
+}
+
+/*
+ * mm_arena_map - mm_map for arena region arena, whose reset or
+ *                destruction unmaps the extent if mm_unmap has not
+ */
+void *mm_arena_map(int arena, size_t len) {
+    size_t mask = mm_pagesize() - 1;
+    unsigned char *lo;
+    extent_t *grown;
+
+    if (len == 0 || len > SIZE_MAX - mask)
+	return NULL;
+    len = (len + mask) & ~mask;
+    lo = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (lo == MAP_FAILED)
+	return NULL;
+    /* Not prefaulted: extents are often far bigger than what is touched */
+    if (page_policy & MEM_HUGEPAGES)
+	madvise(lo, len, MADV_HUGEPAGE);
+    pthread_mutex_lock(&map_lock);
+    if (extent_count == extent_max) {
+	extent_max = extent_max ? 2 * extent_max : 64;
+	if ((grown = realloc(extents, extent_max * sizeof(extent_t))) == NULL) {
+	    pthread_mutex_unlock(&map_lock);
+	    munmap(lo, len);
+	    return NULL;
+	}
+	extents = grown;
+    }
+    extents[extent_count].lo = lo;
+    extents[extent_count].len = len;
+    extents[extent_count].owner = arena;
+    extent_count++;
+    map_bytes += len;
+    pthread_mutex_unlock(&map_lock);
+    return lo;
+}
+
+/*
+ * find_extent - the index of the extent starting at lo, or
+ *               extent_count.  Caller holds map_lock.
+ */
+static size_t find_extent(const void *lo) {
+    size_t i;
+
+    for (i = 0; i < extent_count && extents[i].lo != lo; i++)
+	;
+    return i;
+}
+
+/*
+ * mm_unmap - unmap the extent at p, which mm_map or mm_map_resize
+ *            returned, giving its pages back to the system
+ */
+void mm_unmap(void *p) {
+    size_t i;
+
+    pthread_mutex_lock(&map_lock);
+    if ((i = find_extent(p)) == extent_count) {
+	pthread_mutex_unlock(&map_lock);
+	fprintf(stderr, "ERROR: mm_unmap failed.  %p is not a mapped extent\n", p);
+	return;
+    }
+    if (munmap(extents[i].lo, extents[i].len) != 0) {
+	fprintf(stderr, "FAILURE.  munmap couldn't unmap extent %p\n", p);
+	exit(1);
+    }
+    map_bytes -= extents[i].len;
+    extents[i] = extents[--extent_count];
+    pthread_mutex_unlock(&map_lock);
+}
+
+/*
+ * unmap_owned - unmap every extent that belongs to region id
+ */
+static void unmap_owned(int id) {
+    size_t i;
+
+    pthread_mutex_lock(&map_lock);
+    /* Going down, the extent moved into a freed slot has been seen */
+    for (i = extent_count; i-- > 0; ) {
+	if (extents[i].owner != id)
+	    continue;
+	if (munmap(extents[i].lo, extents[i].len) != 0) {
+	    fprintf(stderr, "FAILURE.  munmap couldn't unmap extent %p\n", extents[i].lo);
+	    exit(1);
+	}
+	map_bytes -= extents[i].len;
+	extents[i] = extents[--extent_count];
+    }
+    pthread_mutex_unlock(&map_lock);
+}
+
+/*
+ * mm_map_resize - grow or shrink the extent at p to len bytes, rounded
+ *                 up to whole pages, moving its pages elsewhere if
+ *                 need be but never copying them.  Returns the new
+ *                 start, or NULL if the extent is unchanged.
+ */
+void *mm_map_resize(void *p, size_t len) {
+    size_t mask = mm_pagesize() - 1;
+    unsigned char *lo;
+    size_t i;
+
+    if (len == 0 || len > SIZE_MAX - mask)
+	return NULL;
+    len = (len + mask) & ~mask;
+    pthread_mutex_lock(&map_lock);
+    if ((i = find_extent(p)) == extent_count ||
+	(lo = mremap(p, extents[i].len, len, MREMAP_MAYMOVE)) == MAP_FAILED) {
+	pthread_mutex_unlock(&map_lock);
+	return NULL;
+    }
+    map_bytes += len - extents[i].len;
+    extents[i].lo = lo;
+    extents[i].len = len;
+    pthread_mutex_unlock(&map_lock);
+    return lo;
+}
+
+/*
+ * mm_mapsize - returns the bytes in all mapped extents
+ */
+size_t mm_mapsize(void) {
+    return map_bytes;
+}
+
+/*
+ * mm_purge - give the whole pages in the len bytes at p back to the
+ *            system.  They stay in the heap and read as zeros when
+ *            they are next touched, which costs a page fault.
+ */
+void mm_purge(void *p, size_t len) {
+    uintptr_t mask = mm_pagesize() - 1;
+    uintptr_t lo = ((uintptr_t) p + mask) & ~mask;
+    uintptr_t hi = ((uintptr_t) p + len) & ~mask;
+
+    if (hi > lo && madvise((void *) lo, hi - lo, MADV_DONTNEED) == 0)
+	__atomic_add_fetch(&purge_bytes, hi - lo, __ATOMIC_RELAXED);
+}
+
+/*************** Regions  *******************/
+
+/*
+ * mem_region_create - reserve a new region that can grow to limit
+ *                     bytes, or to REGION_SIZE if limit is 0.  Returns
+ *                     NULL and sets errno if limit is too large or no
+ *                     id or address space is left.
+ */
+mem_region_t *mem_region_create(size_t limit) {
+    size_t mask = mem_pagesize() - 1;
+    mem_region_t *r = NULL;
+    unsigned char *addr, *lo;
+    uintptr_t slot;
+    int id;
+
+    if (limit == 0)
+	limit = REGION_SIZE;
+    if (limit > REGION_SIZE) {
+	errno = EINVAL;
+	return NULL;
+    }
+    limit = (limit + mask) & ~mask;
+    pthread_mutex_lock(&region_lock);
+    for (id = 0; id < MAX_REGIONS && regions[id].lo != NULL; id++)
+	;
+    if (id == MAX_REGIONS) {
+	errno = ENOMEM;
+	goto out;
+    }
+    /* Reserve a slot's worth more than needed, and trim to a slot boundary */
+    addr = mmap(NULL, limit + REGION_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+	goto out;
+    lo = (unsigned char *)(((uintptr_t) addr + REGION_SIZE - 1) & ~(uintptr_t)(REGION_SIZE - 1));
+    if (lo > addr)
+	munmap(addr, lo - addr);
+    munmap(lo + limit, addr + REGION_SIZE - lo);
+    slot = (uintptr_t) lo / REGION_SIZE;
+    if (slot >= SLOT_COUNT) {
+	munmap(lo, limit);
+	errno = ENOMEM;
+	goto out;
+    }
+    if (page_policy & MEM_HUGEPAGES)
+	madvise(lo, limit, MADV_HUGEPAGE);
+    r = &regions[id];
+    r->lo = r->brk = r->faulted = lo;
+    r->limit = limit;
+    r->id = id;
+    region_slots[slot] = id + 1;
+out:
+    pthread_mutex_unlock(&region_lock);
+    return r;
+}
+
+/*
+ * mem_region_destroy - unmap the region r and its extents, and free
+ *                      its id
+ */
+void mem_region_destroy(mem_region_t *r) {
+    unmap_owned(r->id);
+    pthread_mutex_lock(&region_lock);
+    if (munmap(r->lo, r->limit) != 0) {
+	fprintf(stderr, "FAILURE.  munmap couldn't deallocate region %d\n", r->id);
+	exit(1);
+    }
+    region_slots[(uintptr_t) r->lo / REGION_SIZE] = 0;
+    r->lo = r->brk = r->faulted = NULL;
+    pthread_mutex_unlock(&region_lock);
+}
+
+/*
+ * mem_region_sbrk - mm_sbrk for the region r
+ */
+void *mem_region_sbrk(mem_region_t *r, intptr_t incr) {
+    uintptr_t mask = mm_pagesize() - 1;
+    unsigned char *old_brk = r->brk;
+    unsigned char *lo, *hi;
+
+    bool ok = true;
+    if (incr < 0 && old_brk + incr < r->lo) {
+	ok = false;
+	fprintf(stderr, "ERROR: mm_sbrk failed.  Attempt to shrink heap by %ld bytes below its start\n", (long) -incr);
+    } else if (incr > 0 && old_brk + incr > r->lo + r->limit) {
+	ok = false;
+	long alloc = old_brk - r->lo + incr;
+	fprintf(stderr, "ERROR: mm_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+    }
+    if (ok) {
+	r->brk += incr;
+	/* Give back the pages that no longer hold any of the heap */
+	lo = (unsigned char *)(((uintptr_t) r->brk + mask) & ~mask);
+	hi = (unsigned char *)(((uintptr_t) old_brk + mask) & ~mask);
+	if (incr < 0 && hi > lo) {
+	    madvise(lo, hi - lo, MADV_DONTNEED);
+	    if (r->faulted > lo)
+		r->faulted = lo;
+	}
+	/*
+	 * Fault in the rest of the chunk that the new break lies in.  The
+	 * policy may have been set after the heap grew, so never start
+	 * below the old break: the pages there hold live data.
+	 */
+	if ((page_policy & MEM_PREFAULT) && r->brk > r->faulted) {
+	    lo = (unsigned char *)(((uintptr_t) old_brk + mask) & ~mask);
+	    if (lo < r->faulted)
+		lo = r->faulted;
+	    hi = r->lo + (r->brk - r->lo + prefault_chunk - 1) / prefault_chunk * prefault_chunk;
+	    if (hi > r->lo + r->limit)
+		hi = r->lo + r->limit;
+	    if (hi > lo)
+		prefault(lo, hi - lo);
+	    r->faulted = hi;
+	}
+	return (void *) old_brk;
+    } else {
+	errno = ENOMEM;
+	return (void *) -1;
+    }
+}
+
+/*
+ * mem_region_lo - return address of the first byte of the region r
+ */
+void *mem_region_lo(mem_region_t *r) {
+    return (void *) r->lo;
+}
+
+/*
+ * mem_region_hi - return address of the last byte in use in the region r
+ */
+void *mem_region_hi(mem_region_t *r) {
+    return (void *)(r->brk - 1);
+}
+
+/*
+ * mem_region_reset_brk - empty the region r and unmap its extents
+ */
+void mem_region_reset_brk(mem_region_t *r) {
+    r->brk = r->lo;
+    unmap_owned(r->id);
+}
+
+/*
+ * mem_region_size - returns the bytes in use in the region r
+ */
+size_t mem_region_size(mem_region_t *r) {
+    return (size_t)(r->brk - r->lo);
+}
+
+/*
+ * mem_region_id - returns the arena number the mm_arena routines know
+ *                 the region r by
+ */
+int mem_region_id(mem_region_t *r) {
+    return r->id;
+}
+
+/*
+ * mem_region_of - returns the region that p lies in, or NULL
+ */
+mem_region_t *mem_region_of(const void *p) {
+    int id = mm_arena_of(p);
+
+    return id < 0 ? NULL : &regions[id];
+}
+
 /*************** Memory emulation  *******************/
 
+/*
+ * mem_set_policy - choose how regions and extents made from now on
+ *                  meet the page tables: flags is MEM_HUGEPAGES,
+ *                  MEM_PREFAULT, both or neither, and chunk is how
+ *                  far past the break MEM_PREFAULT faults in, rounded
+ *                  up to whole pages, or MEM_PREFAULT_CHUNK if 0
+ */
+void mem_set_policy(int flags, size_t chunk) {
+    size_t mask = mem_pagesize() - 1;
+
+    if (chunk == 0)
+	chunk = MEM_PREFAULT_CHUNK;
+    page_policy = flags;
+    prefault_chunk = (chunk + mask) & ~mask;
+}
+
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model: make the MAX_ARENAS
+ *            regions of the heap, which get the first ids
  */
 void mem_init(){
-    unsigned char* addr = mmap(NULL,                                        /* start*/
-                               MAX_HEAP_SIZE,                               /* length */
-                               PROT_READ | PROT_WRITE,                      /* permissions */
-                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, /* flags */
-                               -1,                                          /* fd */
-                               0);                                          /* offset */
-    if (addr == MAP_FAILED) {
-	fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
-	exit(1);
+    mem_region_t *r;
+    int i;
+
+    pthread_once(&simd_once, simd_best);
+    for (i = 0; i < MAX_ARENAS; i++) {
+	if ((r = mem_region_create(REGION_SIZE)) == NULL || r->id != i) {
+	    fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
+	    exit(1);
+	}
     }
-    heap = addr;
-    mem_max_addr = addr + MAX_HEAP_SIZE;
-    mem_reset_brk();
 }
 
 /* 
- * mem_deinit - free the storage used by the memory system model
+ * mem_deinit - free the storage used by the memory system model: the
+ *              heap and every region still left
  */
 void mem_deinit(void){
-    if (munmap(heap, MAX_HEAP_SIZE) != 0) {
-        fprintf(stderr, "FAILURE.  munmap couldn't deallocate heap space\n");
-        exit(1);
+    int i;
+
+    for (i = 0; i < MAX_REGIONS; i++) {
+	if (regions[i].lo != NULL)
+	    mem_region_destroy(&regions[i]);
     }
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers of the heap and
+ *                 unmap its extents to make it empty; other regions
+ *                 and their extents are left alone
  */
 void mem_reset_brk(){
-    mem_brk = heap;
+    int i;
+
+    for (i = 0; i < MAX_ARENAS; i++)
+	mem_region_reset_brk(&regions[i]);
 }
 
 void *mem_sbrk(intptr_t incr) {
@@ -163,15 +1059,86 @@ void *mem_sbrk(intptr_t incr) {
 }
 
 void *mem_heap_lo(){
-    return (void *) heap;
+    return mm_heap_lo();
 }
 
 void *mem_heap_hi(){
-    return (void *)(mem_brk - 1);
+    return mm_heap_hi();
 }
 
 size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+    return mm_heapsize();
+}
+
+size_t mem_mapsize() {
+    return mm_mapsize();
+}
+
+size_t mem_purgesize() {
+    return purge_bytes;
+}
+
+/*
+ * resident_bytes - the bytes of the len at lo (page-aligned) that are
+ *                  backed by memory right now
+ */
+static size_t resident_bytes(const unsigned char *lo, size_t len) {
+    size_t page = mem_pagesize();
+    size_t pages = (len + page - 1) / page;
+    size_t i, chunk, bytes = 0;
+    unsigned char vec[4096];
+
+    for (; pages > 0; lo += chunk * page, pages -= chunk) {
+	chunk = pages < sizeof(vec) ? pages : sizeof(vec);
+	if (mincore((void *) lo, chunk * page, vec) != 0)
+	    break;
+	for (i = 0; i < chunk; i++)
+	    bytes += (vec[i] & 1) * page;
+    }
+    return bytes;
+}
+
+/*
+ * mem_resident - returns the bytes of the heap and of the mapped
+ *                extents that are backed by memory
+ */
+size_t mem_resident() {
+    size_t bytes = 0;
+    size_t i;
+
+    for (i = 0; i < MAX_ARENAS; i++)
+	bytes += resident_bytes(regions[i].lo, mem_region_size(&regions[i]));
+    pthread_mutex_lock(&map_lock);
+    for (i = 0; i < extent_count; i++)
+	bytes += resident_bytes(extents[i].lo, extents[i].len);
+    pthread_mutex_unlock(&map_lock);
+    return bytes;
+}
+
+/*
+ * mem_page_faults - returns the page faults the process has taken so far
+ */
+long mem_page_faults() {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+	return 0;
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+/*
+ * mem_in_map - whether the bytes lo to hi all lie in one mapped extent
+ */
+bool mem_in_map(const void *lo, const void *hi) {
+    const unsigned char *l = lo, *h = hi;
+    bool found = false;
+    size_t i;
+
+    pthread_mutex_lock(&map_lock);
+    for (i = 0; i < extent_count && !found; i++)
+	found = l >= extents[i].lo && h < extents[i].lo + extents[i].len;
+    pthread_mutex_unlock(&map_lock);
+    return found;
 }
 
 size_t mem_pagesize(){
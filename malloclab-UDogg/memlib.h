@@ -7,14 +7,40 @@
 void *mm_sbrk(intptr_t incr);
 void *mm_heap_lo(void);
 void *mm_heap_hi(void);
+void *mm_arena_sbrk(int arena, intptr_t incr);
+void *mm_arena_lo(int arena);
+void *mm_arena_hi(int arena);
+int mm_arena_of(const void *p);
+int mm_arena_count(void);
 size_t mm_heapsize(void);
 size_t mm_pagesize(void);
 void *mm_memcpy(void *dst, const void *src, size_t n);
 void *mm_memset(void *dst, int c, size_t n);
+void *mm_remap(void *dst, void *src, size_t len);
+void *mm_map(size_t len);
+void *mm_arena_map(int arena, size_t len);
+void mm_unmap(void *p);
+void *mm_map_resize(void *p, size_t len);
+size_t mm_mapsize(void);
+void mm_purge(void *p, size_t len);
 
 /* Functions used for memory emulation */
 /* You should not be calling these functions */
 
+#define MEM_HUGEPAGES 0x1                 /* Ask for transparent huge pages */
+#define MEM_PREFAULT  0x2                 /* Fault in each growth ahead of use */
+#define MEM_PREFAULT_CHUNK (2 * 1024 * 1024) /* Default prefault granularity */
+
+void mem_set_policy(int flags, size_t chunk);
+
+/* Instruction sets for mm_memcpy and mm_memset, narrowest first */
+#define MEM_SIMD_NONE   0                 /* A word at a time */
+#define MEM_SIMD_SSE2   1
+#define MEM_SIMD_AVX2   2
+#define MEM_SIMD_AVX512 3
+#define MEM_SIMD_BEST   MEM_SIMD_AVX512   /* Whatever the CPU has */
+
+int mem_simd_select(int level);
 void mem_init();               
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
@@ -22,8 +48,27 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+bool mem_in_map(const void *lo, const void *hi);
+size_t mem_purgesize(void);
+size_t mem_resident(void);
+long mem_page_faults(void);
 size_t mem_pagesize(void);
 
+/* Independent regions, each with its own break and limit.  A region's
+   id is the arena number that the mm_arena routines take. */
+typedef struct mem_region mem_region_t;
+
+mem_region_t *mem_region_create(size_t limit);
+void mem_region_destroy(mem_region_t *r);
+void *mem_region_sbrk(mem_region_t *r, intptr_t incr);
+void *mem_region_lo(mem_region_t *r);
+void *mem_region_hi(mem_region_t *r);
+void mem_region_reset_brk(mem_region_t *r);
+size_t mem_region_size(mem_region_t *r);
+int mem_region_id(mem_region_t *r);
+mem_region_t *mem_region_of(const void *p);
+
 /* Read len bytes and return value zero-extended to 64 bits */
 /* Require 0 <= len <= 8 */
 uint64_t mem_read(const void *addr, size_t len);
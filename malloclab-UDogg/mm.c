@@ -4,9 +4,153 @@
  * Name: UC Choudhary
  *
  * First Commit Comment just added my name.
- * 
- * 
  *
+ * Design overview
+ * ---------------
+ * Every block starts with an 8-byte header holding the block size and
+ * the allocated bit.  Payloads are 16-byte aligned, so every header
+ * sits 8 bytes below a 16-byte boundary.  The header also records the
+ * state of the block before it: bit 1 (prev-alloc) is set when the
+ * previous block is allocated, and bit 2 (prev-mini) is set when the
+ * previous block is a mini block, so it starts exactly 16 bytes earlier.
+ *
+ * Only free blocks need a footer (a copy of the size and allocated
+ * bit) for coalesce to find their start, and coalesce only looks for
+ * the previous block when the prev-alloc bit says it is free.  So
+ * allocated blocks have no footer and their payload runs right up to
+ * the next header.
+ *
+ * Requests of at most 8 bytes get a 16-byte mini block: a header and a
+ * single payload word.  A free mini block has no room for a footer;
+ * the prev-mini bit of the next header is enough to find it.  Free mini
+ * blocks sit on a list of their own, doubly linked through the one
+ * payload word: it holds the next and previous block as two 32-bit
+ * offsets from the arena in ALIGNMENT units, enough for a 64 GB
+ * region, so coalesce can unlink one without a walk.
+ *
+ * Free blocks are kept on segregated explicit free lists.  A free
+ * block stores the address of the next and previous free block of its
+ * size class in the first two words of its payload.
+ *
+ * The size classes form a two-level (TLSF-style) index.  The first
+ * level splits sizes into powers of two, the second level splits each
+ * power of two into SL_COUNT equal ranges.  Sizes below SMALL_BLOCK_SIZE
+ * all go to first-level class 0, whose second-level classes are 16
+ * bytes apart.  A bitmap per level records which lists are non-empty,
+ * so finding the smallest non-empty class that is guaranteed to fit a
+ * request takes two find-first-set operations instead of a scan over
+ * empty lists.
+ *
+ * Free blocks of TREE_MIN_SIZE bytes or more are not put on a list.
+ * They are nodes of a splay tree keyed by (size, address), with the
+ * left, right and parent links stored in their own payload, which gives
+ * malloc a logarithmic (amortized) best fit for large requests.  The
+ * tree root and the list index (bitmaps and list heads) live at the very
+ * start of the arena (we only have 128 bytes of global memory), followed
+ * by the prologue block, the regular blocks and the epilogue header:
+ *
+ *   | arena | pad | prologue hdr | prologue ftr | blocks ... | epilogue hdr |
+ *
+ * free, coalesce, extend_heap and expand_heap keep the index current:
+ * a block is on its class list exactly when its allocated bit is clear,
+ * and a bitmap bit is set exactly when its list is non-empty.
+ *
+ * The one exception is the free block at the end of the heap, the
+ * wilderness.  It is kept out of the lists and the tree, and find_fit
+ * only falls back on it when nothing else fits, so that it stays whole
+ * for as long as possible.  When even the wilderness is too small,
+ * expand_heap grows the heap by just the shortfall and merges.  When
+ * the last block is allocated, a heap of CHUNK_MIN_HEAP bytes or more
+ * grows by at least CHUNK_PAGES pages, up to a page boundary, and the
+ * slack is left as the wilderness for the next requests; smaller heaps
+ * grow by exactly the request, as there a page of slack would be most
+ * of the heap.  CHUNK_PAGES is 1, so this is page rounding rather than
+ * amortized chunks: on the mdriver traces 4 pages cost 0.8 points of
+ * utilization and 16 pages 3.2, with no gain in throughput.
+ *
+ * Programs tend to free a small block and ask for one of the same size
+ * right away, so free does not coalesce blocks of at most
+ * QUICK_MAX_SIZE bytes.  They go on a LIFO quick list of their exact
+ * size and keep their allocated bit, so to the rest of the heap they
+ * still look in use; malloc hands them out again without touching the
+ * index.  The quick lists are flushed into the index in one sweep when
+ * a list grows past QUICK_LIMIT blocks, or when find_fit misses and the
+ * heap would otherwise have to grow.  Mini blocks are cached too: a
+ * cached block needs only the one link word a mini block has, and the
+ * doubly linked mini list makes the late coalesce cheap.  The last
+ * block is not, as it should merge with the free space that expand_heap
+ * adds behind it.
+ *
+ * The allocator is thread-safe.  Everything above describes one arena:
+ * a heap of its own, in its own memlib arena region, with a lock that
+ * is held while its blocks and index are changed, and a header at the
+ * start of the region.  mm_init creates the first arena and a table of
+ * arenas behind it; the other arenas are created when the first thread
+ * is assigned to them, and threads are assigned round-robin over
+ * ARENAS_PER_CPU arenas per CPU.  A block always goes back to the arena
+ * it came from, whose region memlib can tell from its address.
+ *
+ * In front of the arenas, every thread keeps a small cache of freed
+ * blocks of up to CACHE_MAX_SIZE bytes, CACHE_LIMIT per size.  Like the
+ * quick lists it holds blocks that still look allocated, but it is
+ * private to the thread, so malloc and free take no lock at all when
+ * they hit it.  Before an arena grows, the blocks it owns in the
+ * calling thread's cache go back to it, and a thread's whole cache is
+ * flushed back to the arenas when the thread exits.
+ *
+ * A thread that frees a block of another arena does not take that
+ * arena's lock: it pushes the block on the arena's remote free queue, a
+ * lock-free stack that any number of threads push on with a
+ * compare-and-swap.  Whoever next holds the arena's lock in malloc
+ * takes the whole stack with one atomic exchange and frees the blocks
+ * in a batch, so the lock makes that side single-consumer and the
+ * stack needs no ABA protection.  Queued blocks still look allocated.
+ *
+ * With many more threads than CPUs, per-thread caches hold many more
+ * blocks than can ever be in use at once.  mm_percpu_caches(true) makes
+ * the next mm_init put one cache per CPU in front of the arenas
+ * instead, shared by the threads that run there.  Each size class of a
+ * CPU's cache is a bounded stack that is only pushed and popped in
+ * Linux restartable sequences (rseq): the kernel sends a thread back to
+ * the abort handler if it is preempted or migrated before the final
+ * store, so no lock or atomic instruction is needed.  A thread that
+ * cannot use rseq (another architecture, an older kernel or C library)
+ * keeps a per-thread cache as before.
+ *
+ * The heap can shrink, too.  When a free leaves the wilderness at
+ * TRIM_THRESHOLD bytes or more, arena_trim cuts it back to TRIM_PAD
+ * and gives the pages behind it back with a negative mm_arena_sbrk, so
+ * a burst does not keep its peak memory forever; mm_trim does the same
+ * for every arena on demand, with the caller's pad.
+ *
+ * Free blocks in the middle of the heap cannot be trimmed, but the
+ * whole pages inside them can be purged: given back with mm_purge while
+ * the block stays where it is.  Purging a block that is about to be
+ * reused only buys page faults, so blocks decay first.  tree_insert
+ * stamps a block with the arena's operation count and appends it to
+ * the arena's decay list, which is thus ordered by stamp.  Every
+ * PURGE_INTERVAL operations purge_decayed looks at the front of the
+ * list, the blocks that have stayed free for DECAY_OPS operations, and
+ * purges the oldest of them until half of their bytes are gone.  So
+ * the idle memory still backed by pages halves every PURGE_INTERVAL
+ * operations instead of dropping all at once, and a sweep only touches
+ * the blocks it may purge.  A purged block leaves the list and is
+ * marked so until it is reused.
+ *
+ * Requests whose blocks, header and padding included, are MAP_MIN_SIZE
+ * bytes or more never make an arena grow.  When the arena's free space
+ * cannot hold one, it gets an extent of its own from mm_map, with the
+ * header ALIGNMENT bytes in and MAPPED_BIT set, and free gives the
+ * pages straight back with mm_unmap.  realloc resizes such blocks with
+ * mm_map_resize, which moves pages rather than bytes.
+ *
+ * All of this lives in an allocator context (mm_ctx_t) that owns a
+ * range of fresh memlib arena regions.  The context itself is stored
+ * right behind the arena header in the first of them, and each thread
+ * finds its home arena and cache for a context under the context's own
+ * pthread key, so contexts share no state and several heaps can be
+ * used side by side.  malloc, free, realloc and calloc are thin
+ * wrappers over a default context on every region, made by mm_init.
  */
 #include <assert.h>
 #include <stdlib.h>
@@ -15,6 +159,14 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#if defined(__x86_64__) && defined(__linux__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#define HAVE_RSEQ 1
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -39,9 +191,136 @@
 #endif
 
 #define ALIGNMENT 16
-#define HEADER_SIZE 4
+#define WSIZE 8
+#define HEADER_SIZE 8
 #define FOOTER_SIZE 8
-#define INITIAL_HEAP_SIZE 8
+#define MIN_BLOCK_SIZE 32      // free block: header + next + prev + footer
+#define MINI_BLOCK_SIZE 16     // header + one payload word, never a footer
+#define ALLOC_BIT 0x1
+#define PREV_ALLOC_BIT 0x2     // the previous block is allocated
+#define PREV_MINI_BIT 0x4      // the previous block is a mini block
+#define MAPPED_BIT 0x8         // the block is a mapped extent of its own
+#define INITIAL_HEAP_SIZE 64
+#define CHUNK_PAGES 1          // least heap growth, in pages, after an allocated last block
+#define CHUNK_MIN_HEAP (256 * 1024) // ... once the heap is this large
+#define ALIGN_SHIFT 4          // log2(ALIGNMENT)
+#define SL_SHIFT 3             // log2(SL_COUNT)
+#define SL_COUNT 8             // second-level classes per power of two
+#define FL_SHIFT (SL_SHIFT + ALIGN_SHIFT)
+#define SMALL_BLOCK_SIZE (1 << FL_SHIFT) // sizes below this share first-level class 0
+#define TREE_SHIFT 12
+#define TREE_MIN_SIZE (1 << TREE_SHIFT) // free blocks this large go in the splay tree
+#define FL_COUNT (TREE_SHIFT - FL_SHIFT + 1) // first-level classes below TREE_MIN_SIZE
+#define MAX_FIT_SCAN 8         // blocks probed in the request's own class
+#define MIN_SPLIT_SIZE 16      // smallest remainder worth splitting off a block
+#define HIGH_PLACEMENT_SIZE 256 // blocks this large are carved from the high end
+#define REMAP_MIN_SIZE (64 * 1024) // realloc moves payloads this large by remapping pages
+#define MAP_MIN_SIZE (128 * 1024) // requests this large get a mapped extent
+#define TRIM_THRESHOLD (256 * 1024) // free trims a wilderness this large ...
+#define TRIM_PAD (64 * 1024)   // ... down to this many bytes
+#define PURGE_INTERVAL 4096    // arena operations between purge sweeps (a power of 2)
+#define DECAY_OPS 16384        // operations a tree block stays free before it may be purged
+#define QUICK_MAX_SIZE 128     // freed blocks up to this size skip coalescing
+#define QUICK_COUNT ((QUICK_MAX_SIZE - MINI_BLOCK_SIZE) / ALIGNMENT + 1) // one per size
+#define QUICK_LIMIT 32         // blocks a quick list holds before a flush
+#define CACHE_MAX_SIZE 256     // freed blocks up to this size go to the thread cache
+#define CACHE_COUNT ((CACHE_MAX_SIZE - MINI_BLOCK_SIZE) / ALIGNMENT + 1) // one per size
+#define CACHE_LIMIT 8          // blocks a thread caches per size
+#define CPU_CACHE_LIMIT 32     // blocks a CPU caches per size
+#define ARENAS_PER_CPU 4       // arenas threads are spread over, per online CPU
+
+/*
+ * An arena, stored at the start of its memlib region: its lock, its
+ * region number, the payload of its prologue block, and its free block
+ * index.  Bit fl of fl_bitmap is set when any list of first-level
+ * class fl is non-empty, and bit sl of sl_bitmap[fl] is set when
+ * heads[fl][sl] is non-empty.  Free mini blocks are kept apart on the
+ * mini_head list, and large free blocks in the splay tree
+ * rooted at tree_root.  wilderness is the free block at the end of the
+ * heap, or NULL.
+ * quick_heads[i] lists the cached blocks of MINI_BLOCK_SIZE + i * ALIGNMENT
+ * bytes, and quick_counts[i] their number.  remote_head is the remote
+ * free queue, the only field touched without the lock.  ctx is the
+ * context the arena belongs to.  ops counts the arena's mallocs and
+ * frees, the clock that free tree blocks decay by, and decay_head and
+ * decay_tail are the oldest and newest unpurged tree blocks.
+ * free_bytes is the size of all blocks in the free index and the
+ * wilderness.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int id;
+    mm_ctx_t *ctx;
+    char *heap_listp;
+    uint64_t fl_bitmap;
+    uint8_t sl_bitmap[FL_COUNT];
+    uint8_t quick_counts[QUICK_COUNT];
+    char *mini_head;
+    char *tree_root;
+    char *decay_head;
+    char *decay_tail;
+    char *wilderness;
+    char *quick_heads[QUICK_COUNT];
+    char *heads[FL_COUNT][SL_COUNT];
+    char *remote_head;
+    unsigned long ops;
+    size_t free_bytes;
+} arena_t;
+
+/*
+ * One size class of a CPU's cache: a stack of count blocks in slots[].
+ * It is only changed in restartable sequences on that CPU.
+ */
+typedef struct {
+    long count;
+    char *slots[CPU_CACHE_LIMIT];
+} cpu_list_t;
+
+typedef struct {
+    cpu_list_t lists[CACHE_COUNT];
+} cpu_cache_t;
+
+/*
+ * An allocator context, stored behind the arena header of its first
+ * region.  arenas[i] is the arena in memlib region first + i, or NULL
+ * until a thread is assigned to it; count is the number of arenas
+ * threads are spread over, and next the round-robin counter.  lock
+ * serializes assigning threads.  cpu_caches holds cpu_count per-CPU
+ * caches, or is NULL when threads use per-thread caches.  key holds
+ * each thread's thread_state_t for this context, and serial tells
+ * this context from every other one made before.
+ */
+struct mm_ctx {
+    pthread_mutex_t lock;
+    pthread_key_t key;
+    unsigned serial;
+    int first;
+    int count;
+    unsigned next;
+    cpu_cache_t *cpu_caches;
+    int cpu_count;
+    arena_t *arenas[];
+};
+
+/*
+ * A thread's cache, allocated from its home arena.  heads[i] lists the
+ * cached blocks of MINI_BLOCK_SIZE + i * ALIGNMENT bytes, which may come
+ * from any arena, and counts[i] their number.
+ */
+typedef struct {
+    char *heads[CACHE_COUNT];
+    uint8_t counts[CACHE_COUNT];
+} thread_cache_t;
+
+/*
+ * A thread's state in one context, allocated from its home arena: the
+ * arena it allocates from and its cache, which is NULL when the thread
+ * uses the CPU caches.
+ */
+typedef struct {
+    arena_t *home;
+    thread_cache_t *cache;
+} thread_state_t;
 
 // Function prototypes
 bool mm_init(void);
@@ -59,23 +338,109 @@ static inline void* HDRP(void* bp);
 static inline void* FTRP(void* bp);
 static inline size_t GET_SIZE(const void* p);
 static inline int GET_ALLOC(const void* p);
+static inline int GET_PREV_ALLOC(const void* p);
+static inline int GET_PREV_MINI(const void* p);
+static inline bool IS_MAPPED(const void* bp);
 static inline void* NEXT_BLKP(void* bp);
 static inline void* PREV_BLKP(void* bp);
+static inline void* NEXT_FREE(const void* bp);
+static inline void* PREV_FREE(const void* bp);
+static inline void SET_NEXT_FREE(void* bp, void* next);
+static inline void SET_PREV_FREE(void* bp, void* prev);
+static inline char* MINI_NEXT(const void* bp);
+static inline char* MINI_PREV(const void* bp);
+static inline void SET_MINI_NEXT(void* bp, void* next);
+static inline void SET_MINI_PREV(void* bp, void* prev);
+static inline char* TREE_LEFT(const void* bp);
+static inline char* TREE_RIGHT(const void* bp);
+static inline char* TREE_PARENT(const void* bp);
+static inline void SET_TREE_LEFT(void* bp, void* left);
+static inline void SET_TREE_RIGHT(void* bp, void* right);
+static inline void SET_TREE_PARENT(void* bp, void* parent);
+static inline unsigned long FREED_AT(const void* bp);
+static inline void SET_FREED_AT(void* bp, unsigned long ops);
+static inline bool IS_PURGED(const void* bp);
+static inline void SET_PURGED(void* bp, bool purged);
+static inline char* DECAY_NEXT(const void* bp);
+static inline char* DECAY_PREV(const void* bp);
+static inline void SET_DECAY_NEXT(void* bp, void* next);
+static inline void SET_DECAY_PREV(void* bp, void* prev);
 static inline int MAX(int x, int y);
 bool mm_checkheap(int lineno);
 static bool in_heap(const void* p);
 static bool aligned(const void* p);
-static uint64_t get_total_block_size(uint64_t* block_ptr);
-static uint64_t is_block_allocated(uint64_t* block_ptr);
-static uint64_t* get_next_block(uint64_t* block_ptr);
-static void* get_payload_ptr(uint64_t* block_ptr);
-static void split_and_allocate_block(uint64_t* block_ptr);
+static size_t adjusted_size(size_t size);
+static size_t payload_size(void *bp);
+static void write_block(void *bp, size_t size, int alloc);
+static void mapping_insert(size_t asize, int *fl, int *sl);
+static void mapping_search(size_t asize, int *fl, int *sl);
+static void *find_suitable_block(int *fl, int *sl);
+static void insert_free_block(void *bp);
+static void remove_free_block(void *bp);
+static void *find_fit(size_t asize);
+static bool tree_key_less(const char *a, const char *b);
+static void tree_rotate_left(char *x);
+static void tree_rotate_right(char *x);
+static void tree_splay(char *x);
+static void tree_replace(char *u, char *v);
+static void tree_insert(char *bp);
+static void tree_remove(char *bp);
+static char *tree_best_fit(size_t asize);
+static char *tree_next(char *x);
+static void decay_unlink(char *bp);
+static void purge_decayed(void);
+static bool checktree(int line, size_t *tree_blocks);
+static bool checkdecay(int line);
+static inline int CLASS_INDEX(size_t asize);
+static inline arena_t* ARENA_OF(const void* bp);
+static void arena_lock(arena_t *a);
+static void arena_unlock(void);
+static arena_t *arena_create(mm_ctx_t *ctx, int id, size_t extra);
+static void *arena_malloc(size_t asize);
+static void arena_free(void *bp);
+static bool arena_trim(size_t pad);
+static bool checkarena(int line);
+static thread_state_t *thread_state(mm_ctx_t *ctx);
+static void *cache_pop(mm_ctx_t *ctx, thread_state_t *ts, int i);
+static bool cache_push(mm_ctx_t *ctx, thread_state_t *ts, void *bp, int i);
+static struct rseq *rseq_register(void);
+static void *cpu_list_pop(mm_ctx_t *ctx, int i);
+static bool cpu_list_push(mm_ctx_t *ctx, int i, void *bp);
+static bool flush_cpu_cache(mm_ctx_t *ctx);
+static thread_state_t *thread_attach(mm_ctx_t *ctx);
+static void thread_detach(void *state);
+static bool checkcache(mm_ctx_t *ctx, int line);
+static bool flush_thread_cache(void);
+static void remote_free(arena_t *a, void *bp);
+static void drain_remote_frees(void);
+static bool checkremote(int line);
+static bool flush_quick_lists(void);
+static size_t cached_bytes(void);
+static bool checkquicklists(int line);
+static void *split_and_allocate_block(void *bp, size_t asize);
+static void split_tail(void *bp, size_t asize);
+static bool resize_in_place(void *bp, size_t asize);
+static void *remap_realloc(void *ptr, size_t size);
+static void *map_malloc(int id, size_t size);
+static void *map_realloc(void *ptr, size_t size);
 static bool checkblock(void *bp);
+static bool checkfreelists(int line, size_t heap_free_blocks);
 static void printblock(void *bp);
-static uint64_t* expand_heap(size_t size);
+static void *expand_heap(size_t size);
 
-uint64_t* prologue;
-static char *heap_listp; // Pointer to first block
+static mm_ctx_t *default_ctx;      // What malloc and friends work on, made by mm_init
+static pthread_key_t default_key;  // Its key, deleted by the next mm_init
+static unsigned ctx_serial;        // The serial of the last context made
+static bool use_percpu;            // mm_init sets up per-CPU caches
+static __thread arena_t *arena;          // The arena whose lock this thread holds
+static __thread thread_state_t *tstate;  // This thread's state in the context ...
+static __thread unsigned tstate_serial;  // ... with this serial
+#ifdef HAVE_RSEQ
+static __thread struct rseq *rseq_area;  // This thread's rseq area, once registered
+static __thread struct rseq own_rseq;    // Registered if the C library did not register one
+#else
+static __thread void *rseq_area;
+#endif
 
 
 //rounds up to the nearest multiple of ALIGNMENT
@@ -105,291 +470,2090 @@ static inline void* FTRP(void* bp) {
 }
 
 static inline size_t GET_SIZE(const void* p) {
-    return GET(p) & ~0x7;
+    return GET(p) & ~(size_t)0xF;
 }
 
 static inline int GET_ALLOC(const void* p) {
-    return GET(p) & 0x1;
+    return GET(p) & ALLOC_BIT;
+}
+
+static inline int GET_PREV_ALLOC(const void* p) {
+    return (GET(p) & PREV_ALLOC_BIT) != 0;
+}
+
+static inline int GET_PREV_MINI(const void* p) {
+    return (GET(p) & PREV_MINI_BIT) != 0;
+}
+
+// Whether bp is a block in a mapped extent of its own
+static inline bool IS_MAPPED(const void* bp) {
+    return (GET((const char *)bp - HEADER_SIZE) & MAPPED_BIT) != 0;
 }
 
 static inline void* NEXT_BLKP(void* bp) {
     return (char*)bp + GET_SIZE((char*)bp - HEADER_SIZE);
 }
 
+// Only valid when the previous block is free: allocated blocks have no
+// footer, and mini blocks never do, so the prev-mini bit tells us where they start
 static inline void* PREV_BLKP(void* bp) {
+    if (GET_PREV_MINI(HDRP(bp)))
+        return (char*)bp - MINI_BLOCK_SIZE;
     return (char*)bp - GET_SIZE((char*)bp - HEADER_SIZE - FOOTER_SIZE);
 }
 
+// The free list links live in the first two payload words of a free block
+static inline void* NEXT_FREE(const void* bp) {
+    return *((void**)bp);
+}
+
+static inline void* PREV_FREE(const void* bp) {
+    return *((void**)bp + 1);
+}
+
+static inline void SET_NEXT_FREE(void* bp, void* next) {
+    *((void**)bp) = next;
+}
+
+static inline void SET_PREV_FREE(void* bp, void* prev) {
+    *((void**)bp + 1) = prev;
+}
+
+// A free mini block's links: offsets from the locked arena in ALIGNMENT
+// units, next in the low and prev in the high half of its payload word.
+// Offset 0 is the arena itself, so it stands for NULL.
+static inline uint32_t mini_link(const void* bp) {
+    uintptr_t off = bp == NULL ? 0 : ((uintptr_t)bp - (uintptr_t)arena) >> ALIGN_SHIFT;
+
+    dbg_assert(off <= UINT32_MAX);
+    return (uint32_t)off;
+}
+
+static inline char* mini_block(uint32_t link) {
+    return link == 0 ? NULL : (char*)arena + ((uintptr_t)link << ALIGN_SHIFT);
+}
+
+static inline char* MINI_NEXT(const void* bp) {
+    return mini_block(((const uint32_t*)bp)[0]);
+}
+
+static inline char* MINI_PREV(const void* bp) {
+    return mini_block(((const uint32_t*)bp)[1]);
+}
+
+static inline void SET_MINI_NEXT(void* bp, void* next) {
+    ((uint32_t*)bp)[0] = mini_link(next);
+}
+
+static inline void SET_MINI_PREV(void* bp, void* prev) {
+    ((uint32_t*)bp)[1] = mini_link(prev);
+}
+
+// Splay tree links of a large free block, in its first three payload words
+static inline char* TREE_LEFT(const void* bp) {
+    return *((char**)bp);
+}
+
+static inline char* TREE_RIGHT(const void* bp) {
+    return *((char**)bp + 1);
+}
+
+static inline char* TREE_PARENT(const void* bp) {
+    return *((char**)bp + 2);
+}
+
+static inline void SET_TREE_LEFT(void* bp, void* left) {
+    *((void**)bp) = left;
+}
+
+static inline void SET_TREE_RIGHT(void* bp, void* right) {
+    *((void**)bp + 1) = right;
+}
+
+static inline void SET_TREE_PARENT(void* bp, void* parent) {
+    *((void**)bp + 2) = parent;
+}
+
+// The arena operation a tree block was freed at
+static inline unsigned long FREED_AT(const void* bp) {
+    return *((unsigned long*)bp + 3);
+}
+
+static inline void SET_FREED_AT(void* bp, unsigned long ops) {
+    *((unsigned long*)bp + 3) = ops;
+}
+
+// Whether a tree block's pages have been purged since it was freed
+static inline bool IS_PURGED(const void* bp) {
+    return *((unsigned long*)bp + 4) != 0;
+}
+
+static inline void SET_PURGED(void* bp, bool purged) {
+    *((unsigned long*)bp + 4) = purged;
+}
+
+// Decay list links of an unpurged tree block, in its next two payload words
+static inline char* DECAY_NEXT(const void* bp) {
+    return *((char**)bp + 5);
+}
+
+static inline char* DECAY_PREV(const void* bp) {
+    return *((char**)bp + 6);
+}
+
+static inline void SET_DECAY_NEXT(void* bp, void* next) {
+    *((void**)bp + 5) = next;
+}
+
+static inline void SET_DECAY_PREV(void* bp, void* prev) {
+    *((void**)bp + 6) = prev;
+}
+
+// The quick list or thread cache list of blocks of asize bytes
+static inline int CLASS_INDEX(size_t asize) {
+    return (asize - MINI_BLOCK_SIZE) >> ALIGN_SHIFT;
+}
+
+// The arena that the block bp belongs to, at the start of its region
+static inline arena_t* ARENA_OF(const void* bp) {
+    return (arena_t *)mm_arena_lo(mm_arena_of(bp));
+}
+
 static inline int MAX(int x, int y) {
     return x > y ? x : y;
 }
 
 
 /*
- * mm_init: returns false on error, true on success.
+ * mm_init: returns false on error, true on success.  Makes a new
+ * default context on every memlib arena region.
  */
 
-bool mm_init(void) 
+bool mm_init(void)
 {
-    if ((heap_listp = mem_sbrk(4*HEADER_SIZE)) == (void*)-1)
-        return -1;
-    PUT(heap_listp, 0);
-    PUT(heap_listp + (1*HEADER_SIZE), PACK(FOOTER_SIZE, 1));
-    PUT(heap_listp + (2*HEADER_SIZE), PACK(FOOTER_SIZE, 1));
-    PUT(heap_listp + (3*HEADER_SIZE), PACK(0,1));
-    heap_listp += (2*HEADER_SIZE);
-    if (extend_heap(INITIAL_HEAP_SIZE/HEADER_SIZE) == NULL)
+    if (default_ctx != NULL)
+        pthread_key_delete(default_key);
+    if ((default_ctx = mm_ctx_init(0, mm_arena_count(), use_percpu)) == NULL)
         return false;
+    default_key = default_ctx->key;
     return true;
 }
 
+/*
+ * mm_percpu_caches - use per-CPU instead of per-thread caches in the
+ * default context from the next mm_init on.  Returns whether the
+ * calling thread can use per-CPU caches, that is, whether it has rseq.
+ */
+bool mm_percpu_caches(bool enable)
+{
+    use_percpu = enable;
+    return rseq_register() != NULL;
+}
+
+/*
+ * mm_ctx_init - make a context on the memlib arena regions first to
+ * first + regions - 1, which must all exist and be empty, with per-CPU
+ * caches if percpu is set.  Returns NULL on error.
+ */
+mm_ctx_t *mm_ctx_init(int first, int regions, bool percpu)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = ARENAS_PER_CPU * (cpus > 0 ? cpus : 1);
+    int cpu_count = 0;
+    size_t ctx_size;
+    mm_ctx_t *ctx;
+    arena_t *a;
+    int i;
+
+    if (first < 0 || regions < 1)
+        return NULL;
+    for (i = first; i < first + regions; i++) {
+        if (mm_arena_lo(i) == NULL || (char *)mm_arena_hi(i) + 1 != (char *)mm_arena_lo(i))
+            return NULL;
+    }
+    if (count > regions)
+        count = regions;
+    if (percpu) {
+        cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+        if (cpu_count < 1)
+            cpu_count = 1;
+    }
+    ctx_size = align(sizeof(mm_ctx_t) + count * sizeof(arena_t *));
+    ctx = (mm_ctx_t *)((char *)mm_arena_lo(first) + sizeof(arena_t));
+    if ((a = arena_create(ctx, first, ctx_size + cpu_count * sizeof(cpu_cache_t))) == NULL)
+        return NULL;
+    memset(ctx, 0, ctx_size + cpu_count * sizeof(cpu_cache_t));
+    if (pthread_key_create(&ctx->key, thread_detach) != 0)
+        return NULL;
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->serial = __atomic_add_fetch(&ctx_serial, 1, __ATOMIC_RELAXED);
+    ctx->first = first;
+    ctx->count = count;
+    if (percpu) {
+        ctx->cpu_caches = (cpu_cache_t *)((char *)ctx + ctx_size);
+        ctx->cpu_count = cpu_count;
+    }
+    ctx->arenas[0] = a;
+    return ctx;
+}
+
+/*
+ * mm_ctx_destroy - forget the context ctx.  Threads must not use it
+ * any more; its regions keep their memory until memlib resets them.
+ */
+void mm_ctx_destroy(mm_ctx_t *ctx)
+{
+    pthread_key_delete(ctx->key);
+    if (tstate_serial == ctx->serial)
+        tstate_serial = 0;
+    ctx->serial = 0;
+}
+
+/*
+ * arena_create - set up the arena of context ctx in memlib region id:
+ * the arena header, extra bytes for the caller behind it, the prologue
+ * and epilogue, and a first free block.
+ */
+static arena_t *arena_create(mm_ctx_t *ctx, int id, size_t extra)
+{
+    char *base = mm_arena_sbrk(id, 0);
+    // Pad so that the prologue header sits 8 bytes below an aligned address
+    uintptr_t start = (uintptr_t)base + sizeof(arena_t) + extra;
+    size_t pad = (align(start + HEADER_SIZE) - HEADER_SIZE) - start;
+    char *heap_listp;
+
+    if (mm_arena_sbrk(id, sizeof(arena_t) + extra + pad + 3*WSIZE) == (void*)-1)
+        return NULL;
+    arena = (arena_t *)base;
+    memset(arena, 0, sizeof(arena_t));
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->id = id;
+    arena->ctx = ctx;
+    heap_listp = base + sizeof(arena_t) + extra + pad;
+    PUT(heap_listp, PACK(HEADER_SIZE + FOOTER_SIZE, 1));        // prologue header
+    PUT(heap_listp + (1*WSIZE), PACK(HEADER_SIZE + FOOTER_SIZE, 1)); // prologue footer
+    PUT(heap_listp + (2*WSIZE), PACK(0, 1) | PREV_ALLOC_BIT);   // epilogue header
+    arena->heap_listp = heap_listp + HEADER_SIZE;
+    if (extend_heap(INITIAL_HEAP_SIZE/WSIZE) == NULL)
+        return NULL;
+    return arena;
+}
+
 // extend_heap - Extend heap with free block and return its block pointer
-static void *extend_heap(size_t words) 
+static void *extend_heap(size_t words)
 {
     char *bp;
     size_t size;
-    size = (words % 2) ? (words+1) * HEADER_SIZE : words * HEADER_SIZE;
-    if ((long)(bp = mem_sbrk(size)) == -1)
+    size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
+    if ((long)(bp = mm_arena_sbrk(arena->id, size)) == -1)
         return NULL;
-    PUT(HDRP(bp), PACK(size,0));
-    PUT(FTRP(bp), PACK(size,0));
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0,1));
+    PUT((char*)bp + size - HEADER_SIZE, PACK(0,1)); // new epilogue
+    write_block(bp, size, 0);             // the old epilogue becomes the header
     return coalesce(bp);
 }
 
-// coalesce - Boundary tag coalescing. Return ptr to coalesced block
-static void *coalesce(void *bp) 
+/*
+ * coalesce - Boundary tag coalescing.  bp must be marked free and must
+ * not be on a free list yet.  Free neighbours are taken off their lists,
+ * and the merged block is put on the list of its size class.
+ * Return ptr to coalesced block.
+ */
+static void *coalesce(void *bp)
 {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE (HDRP(bp));
-    
+
     if (prev_alloc && next_alloc) {
-        return bp;
+        // nothing to merge
     }
-    
     else if (prev_alloc && !next_alloc){
+        remove_free_block(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK(size,0));
-        PUT(FTRP(bp), PACK(size, 0));
+        write_block(bp, size, 0);
     }
     else if (!prev_alloc && next_alloc){
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
         bp = PREV_BLKP(bp);
+        remove_free_block(bp);
+        size += GET_SIZE(HDRP(bp));
+        write_block(bp, size, 0);
     }
     else{
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)))+GET_SIZE(FTRP(NEXT_BLKP(bp)));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+        remove_free_block(NEXT_BLKP(bp));
+        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
         bp = PREV_BLKP(bp);
+        remove_free_block(bp);
+        size += GET_SIZE(HDRP(bp));
+        write_block(bp, size, 0);
     }
-  return bp;
+    insert_free_block(bp);
+    return bp;
+}
+
+void* malloc(size_t size) {
+    return mm_ctx_malloc(default_ctx, size);
+}
+
+void free(void *bp)
+{
+    mm_ctx_free(default_ctx, bp);
+}
+
+void* realloc(void *ptr, size_t size)
+{
+    return mm_ctx_realloc(default_ctx, ptr, size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    return mm_ctx_calloc(default_ctx, nmemb, size);
 }
 
 /*
- * malloc
+ * mm_ctx_malloc - take a block from the thread's or CPU's cache, or
+ * else from the thread's home arena in ctx under its lock
  */
-void* malloc(size_t size) {
-    mm_checkheap(__LINE__);
-    uint64_t total_block_size = (uint64_t)align(size + HEADER_SIZE + FOOTER_SIZE);
-    uint64_t* current_block_ptr;
-    for (current_block_ptr = prologue; get_total_block_size(current_block_ptr) > 0; current_block_ptr = get_next_block(current_block_ptr)) {
-        if (is_block_allocated(current_block_ptr) == 0 && get_total_block_size(current_block_ptr) >= total_block_size) {
-            split_and_allocate_block(current_block_ptr);
-            mm_checkheap(__LINE__);
-            return get_payload_ptr(current_block_ptr);
+void *mm_ctx_malloc(mm_ctx_t *ctx, size_t size) {
+    thread_state_t *ts;
+    size_t asize;
+    void *bp;
+
+    dbg_assert(mm_ctx_checkheap(ctx, __LINE__));
+    if (size == 0 || (ts = thread_state(ctx)) == NULL)
+        return NULL;
+    asize = adjusted_size(size);
+    if (asize <= CACHE_MAX_SIZE &&
+        (bp = cache_pop(ctx, ts, CLASS_INDEX(asize))) != NULL)
+        return bp;
+    arena_lock(ts->home);
+    bp = arena_malloc(asize);
+    arena_unlock();
+    if (bp == NULL && asize >= MAP_MIN_SIZE)
+        bp = map_malloc(ts->home->id, size);
+    dbg_assert(mm_ctx_checkheap(ctx, __LINE__));
+    return bp;
+}
+
+/*
+ * mm_ctx_free - put the block in the thread's or CPU's cache, or else
+ * give it back to its own arena: under the lock if it is our home
+ * arena, and through the arena's remote free queue if it is not
+ */
+void mm_ctx_free(mm_ctx_t *ctx, void *bp)
+{
+    thread_state_t *ts;
+    size_t size;
+
+    if (bp == NULL)
+        return;
+    if (IS_MAPPED(bp)) {
+        mm_unmap((char *)bp - ALIGNMENT);
+        return;
+    }
+    size = GET_SIZE(HDRP(bp));
+    ts = thread_state(ctx);
+    if (ts != NULL && size <= CACHE_MAX_SIZE &&
+        cache_push(ctx, ts, bp, CLASS_INDEX(size)))
+        return;
+    if (ts != NULL && ARENA_OF(bp) != ts->home) {
+        remote_free(ARENA_OF(bp), bp);
+        return;
+    }
+    arena_lock(ARENA_OF(bp));
+    arena_free(bp);
+    arena_unlock();
+    dbg_assert(mm_ctx_checkheap(ctx, __LINE__));
+}
+
+/*
+ * arena_malloc - malloc from the locked arena, for a block of asize
+ * bytes.  Blocks of MAP_MIN_SIZE bytes or more only come from free
+ * space: NULL means the caller should map one.
+ */
+static void *arena_malloc(size_t asize) {
+    void *bp;
+
+    if ((++arena->ops & (PURGE_INTERVAL - 1)) == 0)
+        purge_decayed();
+    drain_remote_frees();
+    if (asize <= QUICK_MAX_SIZE &&
+        (bp = arena->quick_heads[CLASS_INDEX(asize)]) != NULL) {
+        arena->quick_heads[CLASS_INDEX(asize)] = NEXT_FREE(bp);
+        arena->quick_counts[CLASS_INDEX(asize)]--;
+        return bp;
+    }
+    if ((bp = find_fit(asize)) == NULL) {
+        // A large request is mapped unless flushing the caches could make room
+        if (asize >= MAP_MIN_SIZE && arena->free_bytes + cached_bytes() < asize)
+            return NULL;
+        bool flushed = flush_thread_cache();
+        if (!(flush_quick_lists() || flushed) || (bp = find_fit(asize)) == NULL) {
+            if ((bp = expand_heap(asize)) == NULL)
+                return NULL;
         }
     }
-    current_block_ptr = expand_heap(total_block_size);
-    mm_checkheap(__LINE__);
-    return get_payload_ptr(current_block_ptr);
+    return split_and_allocate_block(bp, asize);
 }
 
 /*
- * free
+ * arena_free - free the block bp of the locked arena
  */
-void free(void *bp)
+static void arena_free(void *bp)
 {
     size_t size = GET_SIZE(HDRP(bp));
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
-    coalesce(bp);   
+
+    if ((++arena->ops & (PURGE_INTERVAL - 1)) == 0)
+        purge_decayed();
+    if (size <= QUICK_MAX_SIZE && GET_SIZE(HDRP(NEXT_BLKP(bp))) != 0) {
+        SET_NEXT_FREE(bp, arena->quick_heads[CLASS_INDEX(size)]);
+        arena->quick_heads[CLASS_INDEX(size)] = bp;
+        if (++arena->quick_counts[CLASS_INDEX(size)] > QUICK_LIMIT)
+            flush_quick_lists();
+        return;
+    }
+    write_block(bp, size, 0);
+    bp = coalesce(bp);
+    if (bp == arena->wilderness && GET_SIZE(HDRP(bp)) >= TRIM_THRESHOLD)
+        arena_trim(TRIM_PAD);
+}
+
+/*
+ * arena_trim - shrink the locked arena's wilderness to pad bytes, or
+ * up to the next page boundary, and give the rest of the heap back
+ * with a negative mm_arena_sbrk.  Returns whether anything was released.
+ */
+static bool arena_trim(size_t pad)
+{
+    char *bp = arena->wilderness;
+    size_t page = mm_pagesize();
+    size_t size, keep;
+
+    if (bp == NULL || pad >= (size = GET_SIZE(HDRP(bp))))
+        return false;
+    keep = pad > MIN_BLOCK_SIZE ? pad : MIN_BLOCK_SIZE;
+    // End the heap on a page boundary, like expand_heap
+    keep = (((uintptr_t)bp + keep + page - 1) & ~(uintptr_t)(page - 1)) - (uintptr_t)bp;
+    if (keep >= size)
+        return false;
+    PUT(bp + keep - HEADER_SIZE, PACK(0, 1)); // new epilogue
+    write_block(bp, keep, 0);
+    arena->free_bytes -= size - keep;
+    mm_arena_sbrk(arena->id, -(intptr_t)(size - keep));
+    return true;
 }
 
 
 /*
- * realloc
+ * mm_ctx_realloc
+ * Resizes in place whenever possible: a shrinking block gives its
+ * tail back to the free index, a growing block absorbs a free
+ * successor, and the last block of the heap grows by asking
+ * mm_arena_sbrk for just the shortfall, unless it would grow to
+ * MAP_MIN_SIZE bytes or more: then it is moved to a mapped extent
+ * instead.  Only when none of these apply do we fall back to malloc +
+ * memcpy + free, and large payloads are moved by remapping their pages
+ * instead of copying them (see remap_realloc).  Both happen in the
+ * block's own arena, under its lock.  Mapped blocks whose blocks stay
+ * at least MAP_MIN_SIZE bytes are resized by map_realloc.
  */
-void* realloc(void *ptr, size_t size)
+void *mm_ctx_realloc(mm_ctx_t *ctx, void *ptr, size_t size)
 {
-    void *newp;
-    size_t copySize;
-    newp = mm_malloc(size);
-    if (newp == NULL) {
-        printf("ERROR: mm_malloc failed in mm_realloc\n");
-        exit(1);
+    void *newp = NULL;
+    size_t copySize, asize;
+
+    if (size == 0) {
+        mm_ctx_free(ctx, ptr);
+        return NULL;
+    }
+    if (ptr == NULL)
+        return mm_ctx_malloc(ctx, size);
+    asize = adjusted_size(size);
+    if (IS_MAPPED(ptr)) {
+        if (asize >= MAP_MIN_SIZE)
+            newp = map_realloc(ptr, size);
+    } else {
+        arena_lock(ARENA_OF(ptr));
+        if (resize_in_place(ptr, asize))
+            newp = ptr;
+        else if (size >= REMAP_MIN_SIZE && asize < MAP_MIN_SIZE &&
+                 payload_size(ptr) >= REMAP_MIN_SIZE)
+            newp = remap_realloc(ptr, size);
+        arena_unlock();
     }
-    copySize = GET_SIZE(HDRP(ptr));
+    if (newp != NULL) {
+        dbg_assert(mm_ctx_checkheap(ctx, __LINE__));
+        return newp;
+    }
+    newp = mm_ctx_malloc(ctx, size);
+    if (newp == NULL)
+        return NULL;
+    copySize = payload_size(ptr);
     if (size < copySize) {
         copySize = size;
     }
     memcpy(newp, ptr, copySize);
-    mm_free(ptr);
+    mm_ctx_free(ctx, ptr);
     return newp;
 }
 /*
- * calloc
+ * mm_ctx_calloc
  * This function is not tested by mdriver, and has been implemented for you.
  */
-void* calloc(size_t nmemb, size_t size)
+void *mm_ctx_calloc(mm_ctx_t *ctx, size_t nmemb, size_t size)
 {
     void* ptr;
     size *= nmemb;
-    ptr = malloc(size);
-    if (ptr) {
+    ptr = mm_ctx_malloc(ctx, size);
+    if (ptr && !IS_MAPPED(ptr)) { // fresh extents read as zeros
         memset(ptr, 0, size);
     }
     return ptr;
 }
 
 /*
- * Returns whether the pointer is in the heap.
- * May be useful for debugging.
+ * mm_trim - give back all but pad bytes of the free space at the end
+ * of every arena of the default context.  Returns whether any memory
+ * was released.
  */
-static bool in_heap(const void* p)
+bool mm_trim(size_t pad)
 {
-    return p <= mm_heap_hi() && p >= mm_heap_lo();
+    return mm_ctx_trim(default_ctx, pad);
 }
 
 /*
- * Returns whether the pointer is aligned.
- * May be useful for debugging.
+ * mm_ctx_trim - mm_trim for the context ctx.  Each arena first frees
+ * what waits on its remote free queue and quick lists, and what the
+ * calling thread caches for it, so that it can coalesce into the
+ * wilderness.
  */
-static bool aligned(const void* p)
+bool mm_ctx_trim(mm_ctx_t *ctx, size_t pad)
 {
-    // The address is aligned if it is a multiple of ALIGNMENT
-    // Call the align function to align the value of 'ip'
-    // Check if the aligned value is equal to the original value of 'ip'
-    size_t ip = (size_t) p;
-    return align(ip) == ip;
-}
+    bool trimmed = false;
+    int i;
 
-/*
- * mm_checkheap
- * You call the function via mm_checkheap(__LINE__)
- * The line number can be used to print the line number of the calling
- * function where there was an invalid heap.
- */
-bool mm_checkheap(int line) {
-    void *bp = heap_listp;
-    printf("Checking heap at line %d\n", line); // Print the line number of the calling function
-    if ((GET_SIZE(HDRP(heap_listp)) != FOOTER_SIZE) || !GET_ALLOC(HDRP(heap_listp))) {
-        printf("Bad prologue header at line %d\n", line);
-        return false; // Directly return false if the prologue header is invalid
-    }
-    checkblock(heap_listp);
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        printblock(bp);
-        if (!checkblock(bp)) { // Assuming checkblock returns a bool indicating the block's validity
-            printf("Invalid block at line %d\n", line);
-            return false; // Directly return false if a block is invalid
-        }
-    }    
-    printblock(bp);
-    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp)))) {
-        printf("Bad epilogue header at line %d\n", line);
-        return false; // Directly return false if the epilogue header is invalid
+    for (i = 0; i < ctx->count; i++) {
+        if (ctx->arenas[i] == NULL)
+            continue;
+        arena_lock(ctx->arenas[i]);
+        drain_remote_frees();
+        flush_thread_cache();
+        flush_quick_lists();
+        if (arena_trim(pad))
+            trimmed = true;
+        arena_unlock();
     }
-    return true; // Return true at the end if all checks pass
+    dbg_assert(mm_ctx_checkheap(ctx, __LINE__));
+    return trimmed;
 }
 
-// following are the functions that I have added
-// according to the malloc hint announcement.
-// to implement "clean code" in a modular way.
+/*
+ * map_malloc - a block of size bytes in an extent of its own, which
+ * belongs to arena region id, with the header just below the first
+ * aligned address.  The header holds the extent's length.
+ */
+static void *map_malloc(int id, size_t size)
+{
+    size_t mask = mm_pagesize() - 1;
+    size_t len;
+    char *lo;
 
-uint64_t get_total_block_size(uint64_t* block_ptr) {
-    return *block_ptr;
+    if (size > SIZE_MAX - ALIGNMENT - mask)
+        return NULL;
+    len = (size + ALIGNMENT + mask) & ~mask;
+    if ((lo = mm_arena_map(id, len)) == NULL)
+        return NULL;
+    PUT(lo + ALIGNMENT - HEADER_SIZE, PACK(len, 1) | MAPPED_BIT);
+    return lo + ALIGNMENT;
 }
 
-uint64_t is_block_allocated(uint64_t* block_ptr) {
-    return *block_ptr & 1;
-}
+/*
+ * map_realloc - resize the mapped block ptr to size bytes by resizing
+ * its extent, which may move it.  NULL if that fails.
+ */
+static void *map_realloc(void *ptr, size_t size)
+{
+    size_t mask = mm_pagesize() - 1;
+    size_t len;
+    char *lo;
 
-uint64_t* get_next_block(uint64_t* block_ptr) {
-    return (uint64_t*)((char*)block_ptr + get_total_block_size(block_ptr));
+    if (size > SIZE_MAX - ALIGNMENT - mask)
+        return NULL;
+    len = (size + ALIGNMENT + mask) & ~mask;
+    if (len == GET_SIZE(HDRP(ptr)))
+        return ptr;
+    if ((lo = mm_map_resize((char *)ptr - ALIGNMENT, len)) == NULL)
+        return NULL;
+    PUT(lo + ALIGNMENT - HEADER_SIZE, PACK(len, 1) | MAPPED_BIT);
+    return lo + ALIGNMENT;
 }
 
-void* get_payload_ptr(uint64_t* block_ptr) {
-    return (void*)(block_ptr + 1);
+// arena_lock - lock the arena a and make it the one the helpers work on
+static void arena_lock(arena_t *a)
+{
+    pthread_mutex_lock(&a->lock);
+    arena = a;
 }
 
-void split_and_allocate_block(uint64_t* block_ptr) {
-    *block_ptr |= 1; // Mark the block as allocated
+static void arena_unlock(void)
+{
+    pthread_mutex_unlock(&arena->lock);
 }
 
-
 /*
- * The expand_heap function is designed to increase the heap size dynamically 
- * when the memory allocator cannot find a suitable block of memory to satisfy 
- * an allocation request. Unlike the extend_heap function, which was called 
- * during the initialization of the memory management system to set up an initial 
- * heap size or in specific scenarios where a significant heap extension is needed, 
- * expand_heap is directly tied to the allocator's runtime operations.
-*/
+ * thread_state - the calling thread's state in ctx, attaching the
+ * thread if it has not used ctx yet.  NULL if there is no memory for it.
+ */
+static thread_state_t *thread_state(mm_ctx_t *ctx)
+{
+    thread_state_t *ts;
 
-// Prototype for mem_sbrk, assuming it's similar to sbrk but specific to your memory management system.
-extern void *mem_sbrk(intptr_t incr);
+    if (tstate_serial == ctx->serial)
+        return tstate;
+    if ((ts = pthread_getspecific(ctx->key)) == NULL && (ts = thread_attach(ctx)) == NULL)
+        return NULL;
+    tstate = ts;
+    tstate_serial = ctx->serial;
+    return ts;
+}
 
-// Function to expand the heap by the requested size.
-// Returns a pointer to the newly allocated block or NULL if the allocation fails.
-uint64_t* expand_heap(size_t size) {
-    // Align the requested size
-    size = align(size);
+/*
+ * cache_pop - a cached block of the i-th size, from this CPU's cache
+ * or this thread's, or NULL
+ */
+static void *cache_pop(mm_ctx_t *ctx, thread_state_t *ts, int i)
+{
+    thread_cache_t *cache = ts->cache;
+    char *bp;
 
-    // Request more memory from the OS
-    void* new_block = mem_sbrk(size);
-    if (new_block == (void*)-1) {
-        return NULL; // Failed to allocate more memory
+    if (cache == NULL)
+        return cpu_list_pop(ctx, i);
+    if ((bp = cache->heads[i]) != NULL) {
+        cache->heads[i] = NEXT_FREE(bp);
+        cache->counts[i]--;
     }
+    return bp;
+}
 
-    // Assuming the last block is an epilogue block, we convert it into a header for the new block.
-    // Adjust the header of the new block. The size is already aligned, and we mark it as free (0).
-    uint64_t* header = (uint64_t*)((char*)new_block - HEADER_SIZE);
-    *header = size;
+/*
+ * cache_push - cache the block bp of the i-th size in this CPU's cache
+ * or this thread's.  False if that is full.
+ */
+static bool cache_push(mm_ctx_t *ctx, thread_state_t *ts, void *bp, int i)
+{
+    thread_cache_t *cache = ts->cache;
 
-    // Set up the footer for the new block
-    uint64_t* footer = (uint64_t*)((char*)header + size - FOOTER_SIZE);
-    *footer = size;
+    if (cache == NULL)
+        return cpu_list_push(ctx, i, bp);
+    if (cache->counts[i] >= CACHE_LIMIT)
+        return false;
+    SET_NEXT_FREE(bp, cache->heads[i]);
+    cache->heads[i] = bp;
+    cache->counts[i]++;
+    return true;
+}
 
-    // Create a new epilogue header after the new block
-    uint64_t* new_epilogue = (uint64_t*)((char*)footer + FOOTER_SIZE);
-    *new_epilogue = PACK(0, 1); // Size 0, marked as allocated
+/*
+ * thread_attach - assign the calling thread a home arena in ctx,
+ * round-robin, creating the arena if no thread has used it yet, and
+ * give it an empty cache, unless it can use the CPU caches.
+ */
+static thread_state_t *thread_attach(mm_ctx_t *ctx)
+{
+    thread_state_t *ts;
+    arena_t *home;
+    bool percpu;
+    int id;
+
+    pthread_mutex_lock(&ctx->lock);
+    id = ctx->next++ % ctx->count;
+    if ((home = ctx->arenas[id]) == NULL)
+        home = ctx->arenas[id] = arena_create(ctx, ctx->first + id, 0);
+    pthread_mutex_unlock(&ctx->lock);
+    if (home == NULL)
+        return NULL;
+    if (ctx->cpu_caches != NULL && rseq_area == NULL)
+        rseq_area = rseq_register();
+    percpu = ctx->cpu_caches != NULL && rseq_area != NULL;
+    arena_lock(home);
+    ts = arena_malloc(adjusted_size(sizeof(thread_state_t) +
+                                    (percpu ? 0 : sizeof(thread_cache_t))));
+    arena_unlock();
+    if (ts == NULL)
+        return NULL;
+    ts->home = home;
+    ts->cache = NULL;
+    if (!percpu) {
+        ts->cache = (thread_cache_t *)(ts + 1);
+        memset(ts->cache, 0, sizeof(thread_cache_t));
+    }
+    pthread_setspecific(ctx->key, ts);
+    return ts;
+}
+
+/*
+ * thread_detach - context key destructor: give every block of a
+ * thread's cache, and then its state, back to their arenas when the
+ * thread exits.
+ */
+static void thread_detach(void *state)
+{
+    thread_state_t *ts = state;
+    char *bp, *next;
+    int i;
+
+    for (i = 0; ts->cache != NULL && i < CACHE_COUNT; i++) {
+        for (bp = ts->cache->heads[i]; bp != NULL; bp = next) {
+            next = NEXT_FREE(bp);
+            arena_lock(ARENA_OF(bp));
+            arena_free(bp);
+            arena_unlock();
+        }
+    }
+    if (tstate == ts)
+        tstate_serial = 0;
+    arena_lock(ARENA_OF(ts));
+    arena_free(ts);
+    arena_unlock();
+}
+
+/*
+ * flush_thread_cache - give the blocks of the locked arena in the
+ * calling thread's cache back to it, so that they can coalesce before
+ * the arena grows.  Returns whether there were any.
+ */
+static bool flush_thread_cache(void)
+{
+    thread_cache_t *cache;
+    char **link, *bp;
+    bool flushed = false;
+    int i;
+
+    if (tstate_serial != arena->ctx->serial)
+        return false; // not attached to this context yet
+    if ((cache = tstate->cache) == NULL)
+        return flush_cpu_cache(arena->ctx);
+    for (i = 0; i < CACHE_COUNT; i++) {
+        link = &cache->heads[i];
+        while ((bp = *link) != NULL) {
+            if (ARENA_OF(bp) != arena) {
+                link = (char **)bp;
+                continue;
+            }
+            *link = NEXT_FREE(bp);
+            cache->counts[i]--;
+            arena_free(bp);
+            flushed = true;
+        }
+    }
+    return flushed;
+}
+
+/*
+ * remote_free - push the block bp on the remote free queue of arena a,
+ * whose lock we do not hold
+ */
+static void remote_free(arena_t *a, void *bp)
+{
+    char *head = __atomic_load_n(&a->remote_head, __ATOMIC_RELAXED);
+
+    do {
+        SET_NEXT_FREE(bp, head);
+    } while (!__atomic_compare_exchange_n(&a->remote_head, &head, bp, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * drain_remote_frees - free every block on the locked arena's remote
+ * free queue
+ */
+static void drain_remote_frees(void)
+{
+    char *bp, *next;
+
+    if (__atomic_load_n(&arena->remote_head, __ATOMIC_RELAXED) == NULL)
+        return;
+    bp = __atomic_exchange_n(&arena->remote_head, NULL, __ATOMIC_ACQUIRE);
+    for (; bp != NULL; bp = next) {
+        next = NEXT_FREE(bp);
+        arena_free(bp);
+    }
+}
+
+/*
+ * flush_cpu_cache - empty the cache of the CPU we run on: its blocks
+ * of the locked arena are freed, the others go to their arena's remote
+ * free queue.  Returns whether there were any.
+ */
+static bool flush_cpu_cache(mm_ctx_t *ctx)
+{
+    bool flushed = false;
+    char *bp;
+    int i;
+
+    for (i = 0; i < CACHE_COUNT; i++) {
+        while ((bp = cpu_list_pop(ctx, i)) != NULL) {
+            if (ARENA_OF(bp) == arena)
+                arena_free(bp);
+            else
+                remote_free(ARENA_OF(bp), bp);
+            flushed = true;
+        }
+    }
+    return flushed;
+}
+
+#ifdef HAVE_RSEQ
+/*
+ * rseq_register - the calling thread's rseq area: the one the C
+ * library registered, or else our own, registered now.  NULL if the
+ * kernel does not support rseq.
+ */
+static struct rseq *rseq_register(void)
+{
+    if (__rseq_size > 0)
+        return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+    if (syscall(SYS_rseq, &own_rseq, sizeof(own_rseq), 0, RSEQ_SIG) == 0 || errno == EBUSY)
+        return &own_rseq;
+    return NULL;
+}
+
+/*
+ * cpu_list_pop - pop a block off the i-th list of the cache of the CPU
+ * we run on, or return NULL if that list is empty.
+ *
+ * The restartable sequence runs from 1 to 2: it checks that we are
+ * still on the CPU the list belongs to, loads the top block, and
+ * commits by storing the new count.  The kernel restarts it at 4 if we
+ * are preempted or migrated before that store.  3 describes the
+ * sequence to the kernel, and the abort handler must follow RSEQ_SIG.
+ */
+static void *cpu_list_pop(mm_ctx_t *ctx, int i)
+{
+    cpu_list_t *list;
+    char *bp;
+    int cpu;
+
+    for (;;) {
+        cpu = __atomic_load_n(&rseq_area->cpu_id, __ATOMIC_RELAXED);
+        if (cpu < 0 || cpu >= ctx->cpu_count)
+            return NULL;
+        list = &ctx->cpu_caches[cpu].lists[i];
+        __asm__ __volatile__ goto (
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0, 0\n\t"
+            ".quad 1f, 2f - 1f, 4f\n\t"
+            ".popsection\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, %c[cs](%[rs])\n\t"
+            "1:\n\t"
+            "cmpl %[cpu], %c[cpu_id](%[rs])\n\t"
+            "jnz 4f\n\t"
+            "movq %c[count](%[list]), %%rax\n\t"
+            "testq %%rax, %%rax\n\t"
+            "jz %l[empty]\n\t"
+            "decq %%rax\n\t"
+            "movq %c[slots](%[list], %%rax, 8), %%rcx\n\t"
+            "movq %%rcx, (%[out])\n\t"
+            "movq %%rax, %c[count](%[list])\n\t"
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".byte 0x0f, 0xb9, 0x3d\n\t"
+            ".long %c[sig]\n\t"
+            "4:\n\t"
+            "jmp %l[abort]\n\t"
+            ".popsection\n\t"
+            :
+            : [rs] "r" (rseq_area), [cpu] "r" (cpu), [list] "r" (list), [out] "r" (&bp),
+              [cs] "i" (offsetof(struct rseq, rseq_cs)),
+              [cpu_id] "i" (offsetof(struct rseq, cpu_id)),
+              [count] "i" (offsetof(cpu_list_t, count)),
+              [slots] "i" (offsetof(cpu_list_t, slots)),
+              [sig] "i" (RSEQ_SIG)
+            : "rax", "rcx", "memory", "cc"
+            : empty, abort);
+        return bp;
+    abort:
+        continue;
+    }
+empty:
+    return NULL;
+}
+
+/*
+ * cpu_list_push - push the block bp on the i-th list of the cache of
+ * the CPU we run on.  Returns false if that list is full.  The block
+ * is stored in the free slot before the sequence commits by storing
+ * the new count, so an aborted push leaves nothing behind.
+ */
+static bool cpu_list_push(mm_ctx_t *ctx, int i, void *bp)
+{
+    cpu_list_t *list;
+    int cpu;
 
-    // Return a pointer to the payload of the new block
-    return (uint64_t*)((char*)header + HEADER_SIZE);
+    for (;;) {
+        cpu = __atomic_load_n(&rseq_area->cpu_id, __ATOMIC_RELAXED);
+        if (cpu < 0 || cpu >= ctx->cpu_count)
+            return false;
+        list = &ctx->cpu_caches[cpu].lists[i];
+        __asm__ __volatile__ goto (
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0, 0\n\t"
+            ".quad 1f, 2f - 1f, 4f\n\t"
+            ".popsection\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, %c[cs](%[rs])\n\t"
+            "1:\n\t"
+            "cmpl %[cpu], %c[cpu_id](%[rs])\n\t"
+            "jnz 4f\n\t"
+            "movq %c[count](%[list]), %%rax\n\t"
+            "cmpq %[limit], %%rax\n\t"
+            "jae %l[full]\n\t"
+            "movq %[bp], %c[slots](%[list], %%rax, 8)\n\t"
+            "incq %%rax\n\t"
+            "movq %%rax, %c[count](%[list])\n\t"
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".byte 0x0f, 0xb9, 0x3d\n\t"
+            ".long %c[sig]\n\t"
+            "4:\n\t"
+            "jmp %l[abort]\n\t"
+            ".popsection\n\t"
+            :
+            : [rs] "r" (rseq_area), [cpu] "r" (cpu), [list] "r" (list), [bp] "r" (bp),
+              [limit] "i" (CPU_CACHE_LIMIT),
+              [cs] "i" (offsetof(struct rseq, rseq_cs)),
+              [cpu_id] "i" (offsetof(struct rseq, cpu_id)),
+              [count] "i" (offsetof(cpu_list_t, count)),
+              [slots] "i" (offsetof(cpu_list_t, slots)),
+              [sig] "i" (RSEQ_SIG)
+            : "rax", "memory", "cc"
+            : full, abort);
+        return true;
+    abort:
+        continue;
+    }
+full:
+    return false;
+}
+#else
+// Without rseq every thread keeps a per-thread cache
+static void *rseq_register(void)
+{
+    return NULL;
+}
+
+static void *cpu_list_pop(mm_ctx_t *ctx, int i)
+{
+    return NULL;
+}
+
+static bool cpu_list_push(mm_ctx_t *ctx, int i, void *bp)
+{
+    return false;
+}
+#endif
+
+/*
+ * Returns whether the pointer is in the heap.
+ * May be useful for debugging.
+ */
+static bool in_heap(const void* p)
+{
+    return p <= mm_arena_hi(arena->id) && p >= mm_arena_lo(arena->id);
+}
+
+/*
+ * Returns whether the pointer is aligned.
+ * May be useful for debugging.
+ */
+static bool aligned(const void* p)
+{
+    // The address is aligned if it is a multiple of ALIGNMENT
+    // Call the align function to align the value of 'ip'
+    // Check if the aligned value is equal to the original value of 'ip'
+    size_t ip = (size_t) p;
+    return align(ip) == ip;
+}
+
+/*
+ * mm_checkheap
+ * You call the function via mm_checkheap(__LINE__)
+ * The line number can be used to print the line number of the calling
+ * function where there was an invalid heap.
+ *
+ * Walks the heap in address order checking every block, that no two
+ * free blocks are adjacent, that the prev-alloc and prev-mini bits of
+ * every header describe the block before it, that PREV_BLKP (which
+ * relies on those bits and on free block footers) finds the previous
+ * free block, and that the free lists hold exactly the free blocks of
+ * the heap.  Every arena of the context is checked in turn, under its
+ * lock, and so are the caches.
+ */
+bool mm_checkheap(int line) {
+    return mm_ctx_checkheap(default_ctx, line);
+}
+
+bool mm_ctx_checkheap(mm_ctx_t *ctx, int line) {
+    bool ok = true;
+    int i;
+
+    if (!checkcache(ctx, line))
+        return false;
+    for (i = 0; ok && i < ctx->count; i++) {
+        if (ctx->arenas[i] == NULL)
+            continue;
+        arena_lock(ctx->arenas[i]);
+        ok = checkarena(line);
+        arena_unlock();
+    }
+    return ok;
+}
+
+// checkarena - mm_checkheap for the locked arena
+static bool checkarena(int line) {
+    char *heap_listp = arena->heap_listp;
+    void *bp = heap_listp;
+    void *prev_bp = heap_listp;
+    size_t heap_free_blocks = 0;
+    size_t heap_free_bytes = 0;
+    bool prev_free = false;
+    bool prev_mini = false;
+
+    if ((GET_SIZE(HDRP(heap_listp)) != HEADER_SIZE + FOOTER_SIZE) || !GET_ALLOC(HDRP(heap_listp))) {
+        printf("Bad prologue header at line %d\n", line);
+        return false; // Directly return false if the prologue header is invalid
+    }
+    for (bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+        if (!checkblock(bp)) {
+            printblock(bp);
+            printf("Invalid block at line %d\n", line);
+            return false; // Directly return false if a block is invalid
+        }
+        if (GET_PREV_ALLOC(HDRP(bp)) == prev_free || GET_PREV_MINI(HDRP(bp)) != prev_mini) {
+            printblock(bp);
+            printf("Prev-alloc/prev-mini bits do not match the previous block at line %d\n", line);
+            return false;
+        }
+        if (prev_free && PREV_BLKP(bp) != prev_bp) {
+            printblock(bp);
+            printf("Previous free block cannot be found from %p at line %d\n", bp, line);
+            return false;
+        }
+        if (!GET_ALLOC(HDRP(bp))) {
+            if (prev_free) {
+                printblock(bp);
+                printf("Uncoalesced free blocks at line %d\n", line);
+                return false;
+            }
+            heap_free_blocks++;
+            heap_free_bytes += GET_SIZE(HDRP(bp));
+        }
+        prev_free = !GET_ALLOC(HDRP(bp));
+        prev_mini = GET_SIZE(HDRP(bp)) == MINI_BLOCK_SIZE;
+        prev_bp = bp;
+    }
+    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))) ||
+        GET_PREV_ALLOC(HDRP(bp)) == prev_free || GET_PREV_MINI(HDRP(bp)) != prev_mini) {
+        printblock(bp);
+        printf("Bad epilogue header at line %d\n", line);
+        return false; // Directly return false if the epilogue header is invalid
+    }
+    if ((char *)HDRP(bp) != (char *)mm_arena_hi(arena->id) + 1 - HEADER_SIZE) {
+        printf("Epilogue is not at the end of the heap at line %d\n", line);
+        return false;
+    }
+    if ((prev_free ? prev_bp : NULL) != arena->wilderness) {
+        printf("Free block at the end of the heap is not the wilderness at line %d\n", line);
+        return false;
+    }
+    if (heap_free_bytes != arena->free_bytes) {
+        printf("Arena counts %zu free bytes but the heap has %zu at line %d\n",
+               arena->free_bytes, heap_free_bytes, line);
+        return false;
+    }
+    return checkquicklists(line) && checkremote(line) &&
+           checkfreelists(line, heap_free_blocks);
+}
+
+// following are the functions that I have added
+// according to the malloc hint announcement.
+// to implement "clean code" in a modular way.
+
+// adjusted_size - block size needed to hold a payload of size bytes
+static size_t adjusted_size(size_t size) {
+    size_t asize;
+
+    if (size <= MINI_BLOCK_SIZE - HEADER_SIZE)
+        return MINI_BLOCK_SIZE;
+    // allocated blocks have no footer, but must be large enough to free
+    asize = align(size + HEADER_SIZE);
+    return asize < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : asize;
+}
+
+// payload_size - number of payload bytes of the allocated block bp
+static size_t payload_size(void *bp) {
+    if (IS_MAPPED(bp))
+        return GET_SIZE(HDRP(bp)) - ALIGNMENT;
+    return GET_SIZE(HDRP(bp)) - HEADER_SIZE;
+}
+
+/*
+ * write_block - write the header (keeping its prev-alloc and prev-mini
+ * bits) and, for free regular blocks, the footer of bp.  Then record
+ * the new state of bp in the header of the block that follows it.
+ */
+static void write_block(void *bp, size_t size, int alloc) {
+    size_t prev_bits = GET(HDRP(bp)) & (PREV_ALLOC_BIT | PREV_MINI_BIT);
+    char *next_hdr = (char*)bp + size - HEADER_SIZE;
+    size_t next = GET(next_hdr) & ~(size_t)(PREV_ALLOC_BIT | PREV_MINI_BIT);
+
+    PUT(HDRP(bp), PACK(size, alloc) | prev_bits);
+    if (!alloc && size != MINI_BLOCK_SIZE)
+        PUT(FTRP(bp), PACK(size, alloc));
+    if (alloc)
+        next |= PREV_ALLOC_BIT;
+    if (size == MINI_BLOCK_SIZE)
+        next |= PREV_MINI_BIT;
+    PUT(next_hdr, next);
+}
+
+// mapping_insert - first- and second-level class that holds blocks of asize bytes
+static void mapping_insert(size_t asize, int *fl, int *sl) {
+    int msb;
+
+    if (asize < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = asize >> ALIGN_SHIFT;
+        return;
+    }
+    msb = 63 - __builtin_clzl(asize);
+    *fl = msb - FL_SHIFT + 1;
+    *sl = (asize >> (msb - SL_SHIFT)) ^ SL_COUNT;
+}
+
+/*
+ * mapping_search - smallest class whose blocks are all at least asize
+ * bytes: round asize up to the next second-level boundary and map it.
+ */
+static void mapping_search(size_t asize, int *fl, int *sl) {
+    if (asize >= SMALL_BLOCK_SIZE) {
+        int msb = 63 - __builtin_clzl(asize);
+        asize += ((size_t)1 << (msb - SL_SHIFT)) - 1;
+    }
+    mapping_insert(asize, fl, sl);
+}
+
+/*
+ * find_suitable_block - head of the first non-empty list at or above
+ * class (fl, sl), or NULL.  Updates fl and sl to the class found.
+ */
+static void *find_suitable_block(int *fl, int *sl) {
+    uint64_t fl_map;
+    unsigned sl_map;
+
+    if (*fl >= FL_COUNT)
+        return NULL;
+    sl_map = arena->sl_bitmap[*fl] & (~0U << *sl);
+
+    if (sl_map == 0) {
+        if (*fl + 1 >= FL_COUNT)
+            return NULL;
+        fl_map = arena->fl_bitmap & (~(uint64_t)0 << (*fl + 1));
+        if (fl_map == 0)
+            return NULL;
+        *fl = __builtin_ctzll(fl_map);
+        sl_map = arena->sl_bitmap[*fl];
+    }
+    *sl = __builtin_ctz(sl_map);
+    return arena->heads[*fl][*sl];
+}
+
+// insert_free_block - push bp on the front of its size class list (LIFO)
+static void insert_free_block(void *bp) {
+    int fl, sl;
+    char *head;
+
+    arena->free_bytes += GET_SIZE(HDRP(bp));
+    if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0) {
+        arena->wilderness = bp;
+        return;
+    }
+    if (GET_SIZE(HDRP(bp)) == MINI_BLOCK_SIZE) {
+        head = arena->mini_head;
+        SET_MINI_NEXT(bp, head);
+        SET_MINI_PREV(bp, NULL);
+        if (head != NULL)
+            SET_MINI_PREV(head, bp);
+        arena->mini_head = bp;
+        return;
+    }
+    if (GET_SIZE(HDRP(bp)) >= TREE_MIN_SIZE) {
+        tree_insert(bp);
+        return;
+    }
+    mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+    head = arena->heads[fl][sl];
+    SET_NEXT_FREE(bp, head);
+    SET_PREV_FREE(bp, NULL);
+    if (head != NULL)
+        SET_PREV_FREE(head, bp);
+    arena->heads[fl][sl] = bp;
+    arena->fl_bitmap |= (uint64_t)1 << fl;
+    arena->sl_bitmap[fl] |= 1U << sl;
+}
+
+// remove_free_block - unlink bp from its size class list
+static void remove_free_block(void *bp) {
+    char *next, *prev;
+    int fl, sl;
+
+    arena->free_bytes -= GET_SIZE(HDRP(bp));
+    if (bp == arena->wilderness) {
+        arena->wilderness = NULL;
+        return;
+    }
+    if (GET_SIZE(HDRP(bp)) == MINI_BLOCK_SIZE) {
+        next = MINI_NEXT(bp);
+        prev = MINI_PREV(bp);
+        if (next != NULL)
+            SET_MINI_PREV(next, prev);
+        if (prev != NULL)
+            SET_MINI_NEXT(prev, next);
+        else
+            arena->mini_head = next;
+        return;
+    }
+    if (GET_SIZE(HDRP(bp)) >= TREE_MIN_SIZE) {
+        tree_remove(bp);
+        return;
+    }
+    next = NEXT_FREE(bp);
+    prev = PREV_FREE(bp);
+    if (next != NULL)
+        SET_PREV_FREE(next, prev);
+    if (prev != NULL) {
+        SET_NEXT_FREE(prev, next);
+        return;
+    }
+    mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+    arena->heads[fl][sl] = next;
+    if (next == NULL) {
+        arena->sl_bitmap[fl] &= ~(1U << sl);
+        if (arena->sl_bitmap[fl] == 0)
+            arena->fl_bitmap &= ~((uint64_t)1 << fl);
+    }
+}
+
+/*
+ * find_fit - every block of the class found by mapping_search fits,
+ * so the common case is two bit scans and no list walk.  When no such
+ * class is populated, the request's own class may still hold a block
+ * that is large enough; probe at most MAX_FIT_SCAN of them before
+ * giving up, so the worst case stays bounded.  Large requests, and
+ * small ones that found nothing on the lists, take the best fit from
+ * the splay tree.  The wilderness comes last.
+ */
+static void *find_fit(size_t asize) {
+    int fl, sl, i;
+    char *bp;
+
+    if (asize == MINI_BLOCK_SIZE && arena->mini_head != NULL)
+        return arena->mini_head;
+    if (asize < TREE_MIN_SIZE) {
+        mapping_search(asize, &fl, &sl);
+        if ((bp = find_suitable_block(&fl, &sl)) != NULL)
+            return bp;
+        mapping_insert(asize, &fl, &sl);
+        bp = arena->heads[fl][sl];
+        for (i = 0; bp != NULL && i < MAX_FIT_SCAN; bp = NEXT_FREE(bp), i++) {
+            if (GET_SIZE(HDRP(bp)) >= asize)
+                return bp;
+        }
+    }
+    if ((bp = tree_best_fit(asize)) != NULL)
+        return bp;
+    bp = arena->wilderness;
+    if (bp != NULL && GET_SIZE(HDRP(bp)) >= asize)
+        return bp;
+    return NULL;
+}
+
+/*
+ * flush_quick_lists - free every block on the quick lists for real,
+ * coalescing it with its neighbours.  A cached block still looks
+ * allocated, so two cached neighbours are merged when the second of
+ * them is freed.  Returns false if there was nothing to flush.
+ */
+static bool flush_quick_lists(void) {
+    bool flushed = false;
+    char *bp, *next;
+    int i;
+
+    for (i = 0; i < QUICK_COUNT; i++) {
+        for (bp = arena->quick_heads[i]; bp != NULL; bp = next) {
+            next = NEXT_FREE(bp);
+            write_block(bp, GET_SIZE(HDRP(bp)), 0);
+            coalesce(bp);
+            flushed = true;
+        }
+        arena->quick_heads[i] = NULL;
+        arena->quick_counts[i] = 0;
+    }
+    return flushed;
+}
+
+/*
+ * cached_bytes - an upper bound on the bytes that flushing the locked
+ * arena's quick lists and the calling thread's cache would free: the
+ * quick lists exactly, the thread cache whatever arena its blocks are
+ * from, and a CPU cache at its capacity.
+ */
+static size_t cached_bytes(void) {
+    size_t bytes = 0;
+    int i;
+
+    for (i = 0; i < QUICK_COUNT; i++)
+        bytes += arena->quick_counts[i] * (MINI_BLOCK_SIZE + i * ALIGNMENT);
+    if (tstate_serial != arena->ctx->serial)
+        return bytes;
+    for (i = 0; i < CACHE_COUNT; i++) {
+        if (tstate->cache != NULL)
+            bytes += tstate->cache->counts[i] * (MINI_BLOCK_SIZE + i * ALIGNMENT);
+        else
+            bytes += CPU_CACHE_LIMIT * (MINI_BLOCK_SIZE + i * ALIGNMENT);
+    }
+    return bytes;
+}
+
+/*
+ * The splay tree of large free blocks.  This is the splay tree of
+ * stree.c, made intrusive: the nodes are the free blocks themselves,
+ * so inserting and removing never allocates, and the key is the
+ * (size, address) pair of the block, which is unique.
+ */
+
+// tree_key_less - order large free blocks by size, then by address
+static bool tree_key_less(const char *a, const char *b) {
+    size_t asize = GET_SIZE(a - HEADER_SIZE);
+    size_t bsize = GET_SIZE(b - HEADER_SIZE);
+
+    return asize < bsize || (asize == bsize && a < b);
+}
+
+static void tree_rotate_left(char *x) {
+    char *y = TREE_RIGHT(x);
+    char *p = TREE_PARENT(x);
+
+    SET_TREE_RIGHT(x, TREE_LEFT(y));
+    if (TREE_LEFT(y))
+        SET_TREE_PARENT(TREE_LEFT(y), x);
+    SET_TREE_PARENT(y, p);
+    if (!p)
+        arena->tree_root = y;
+    else if (x == TREE_LEFT(p))
+        SET_TREE_LEFT(p, y);
+    else
+        SET_TREE_RIGHT(p, y);
+    SET_TREE_LEFT(y, x);
+    SET_TREE_PARENT(x, y);
+}
+
+static void tree_rotate_right(char *x) {
+    char *y = TREE_LEFT(x);
+    char *p = TREE_PARENT(x);
+
+    SET_TREE_LEFT(x, TREE_RIGHT(y));
+    if (TREE_RIGHT(y))
+        SET_TREE_PARENT(TREE_RIGHT(y), x);
+    SET_TREE_PARENT(y, p);
+    if (!p)
+        arena->tree_root = y;
+    else if (x == TREE_LEFT(p))
+        SET_TREE_LEFT(p, y);
+    else
+        SET_TREE_RIGHT(p, y);
+    SET_TREE_RIGHT(y, x);
+    SET_TREE_PARENT(x, y);
+}
+
+// tree_splay - rotate x up to the root
+static void tree_splay(char *x) {
+    char *p, *g;
+
+    while ((p = TREE_PARENT(x)) != NULL) {
+        g = TREE_PARENT(p);
+        if (!g) {
+            if (TREE_LEFT(p) == x) tree_rotate_right(p);
+            else tree_rotate_left(p);
+        } else if (TREE_LEFT(p) == x && TREE_LEFT(g) == p) {
+            tree_rotate_right(g);
+            tree_rotate_right(p);
+        } else if (TREE_RIGHT(p) == x && TREE_RIGHT(g) == p) {
+            tree_rotate_left(g);
+            tree_rotate_left(p);
+        } else if (TREE_LEFT(p) == x && TREE_RIGHT(g) == p) {
+            tree_rotate_right(p);
+            tree_rotate_left(g);
+        } else {
+            tree_rotate_left(p);
+            tree_rotate_right(g);
+        }
+    }
+}
+
+// tree_replace - put the subtree v where u was
+static void tree_replace(char *u, char *v) {
+    char *p = TREE_PARENT(u);
+
+    if (!p)
+        arena->tree_root = v;
+    else if (u == TREE_LEFT(p))
+        SET_TREE_LEFT(p, v);
+    else
+        SET_TREE_RIGHT(p, v);
+    if (v)
+        SET_TREE_PARENT(v, p);
+}
+
+// tree_insert - add the free block bp to the tree and splay it to the root
+static void tree_insert(char *bp) {
+    char *z = arena->tree_root;
+    char *p = NULL;
+
+    while (z) {
+        p = z;
+        z = tree_key_less(bp, z) ? TREE_LEFT(z) : TREE_RIGHT(z);
+    }
+    SET_TREE_LEFT(bp, NULL);
+    SET_TREE_RIGHT(bp, NULL);
+    SET_TREE_PARENT(bp, p);
+    SET_FREED_AT(bp, arena->ops);
+    SET_PURGED(bp, false);
+    SET_DECAY_NEXT(bp, NULL);
+    SET_DECAY_PREV(bp, arena->decay_tail);
+    if (arena->decay_tail)
+        SET_DECAY_NEXT(arena->decay_tail, bp);
+    else
+        arena->decay_head = bp;
+    arena->decay_tail = bp;
+    if (!p)
+        arena->tree_root = bp;
+    else if (tree_key_less(p, bp))
+        SET_TREE_RIGHT(p, bp);
+    else
+        SET_TREE_LEFT(p, bp);
+    tree_splay(bp);
+}
+
+// tree_next - the block after x in key order, or NULL
+static char *tree_next(char *x) {
+    char *p;
+
+    if (TREE_RIGHT(x)) {
+        for (x = TREE_RIGHT(x); TREE_LEFT(x); x = TREE_LEFT(x))
+            ;
+        return x;
+    }
+    while ((p = TREE_PARENT(x)) != NULL && x == TREE_RIGHT(p))
+        x = p;
+    return p;
+}
+
+// decay_unlink - take the tree block bp off the decay list
+static void decay_unlink(char *bp) {
+    char *next = DECAY_NEXT(bp);
+    char *prev = DECAY_PREV(bp);
+
+    if (next)
+        SET_DECAY_PREV(next, prev);
+    else
+        arena->decay_tail = prev;
+    if (prev)
+        SET_DECAY_NEXT(prev, next);
+    else
+        arena->decay_head = next;
+}
+
+/*
+ * purge_decayed - of the locked arena's tree blocks that have been
+ * free for DECAY_OPS operations, a prefix of the decay list, purge the
+ * oldest until at least half of their bytes are purged.  A block keeps
+ * its header, tree links, stamp, purged flag and footer.
+ */
+static void purge_decayed(void) {
+    size_t decayed = 0, purged = 0;
+    char *bp, *lo;
+
+    for (bp = arena->decay_head; bp != NULL && arena->ops - FREED_AT(bp) >= DECAY_OPS;
+         bp = DECAY_NEXT(bp))
+        decayed += GET_SIZE(HDRP(bp));
+    while (purged < (decayed + 1) / 2) {
+        bp = arena->decay_head;
+        purged += GET_SIZE(HDRP(bp));
+        decay_unlink(bp);
+        SET_PURGED(bp, true);
+        lo = bp + 5 * WSIZE;
+        mm_purge(lo, (char *)FTRP(bp) - lo);
+    }
+}
+
+// tree_remove - take the free block bp out of the tree
+static void tree_remove(char *bp) {
+    char *y;
+
+    if (!IS_PURGED(bp))
+        decay_unlink(bp);
+    tree_splay(bp);
+    if (!TREE_LEFT(bp))
+        tree_replace(bp, TREE_RIGHT(bp));
+    else if (!TREE_RIGHT(bp))
+        tree_replace(bp, TREE_LEFT(bp));
+    else {
+        y = TREE_RIGHT(bp);
+        while (TREE_LEFT(y))
+            y = TREE_LEFT(y);
+        if (TREE_PARENT(y) != bp) {
+            tree_replace(y, TREE_RIGHT(y));
+            SET_TREE_RIGHT(y, TREE_RIGHT(bp));
+            SET_TREE_PARENT(TREE_RIGHT(y), y);
+        }
+        tree_replace(bp, y);
+        SET_TREE_LEFT(y, TREE_LEFT(bp));
+        SET_TREE_PARENT(TREE_LEFT(y), y);
+    }
+}
+
+/*
+ * tree_best_fit - smallest free block of at least asize bytes (the
+ * lowest-addressed one among equal sizes), or NULL.  The block found is
+ * splayed to the root, so that removing it right after is cheap.
+ */
+static char *tree_best_fit(size_t asize) {
+    char *z = arena->tree_root;
+    char *best = NULL;
+
+    while (z) {
+        if (GET_SIZE(HDRP(z)) >= asize) {
+            best = z;
+            z = TREE_LEFT(z);
+        } else {
+            z = TREE_RIGHT(z);
+        }
+    }
+    if (best)
+        tree_splay(best);
+    return best;
+}
+
+/*
+ * split_and_allocate_block - take the free block bp off its list and
+ * allocate asize bytes of it.  If at least MIN_SPLIT_SIZE bytes are
+ * left over, they are split off and go back into the free index.
+ * Small requests are carved from the low end of the block and large
+ * ones from the high end, so short-lived small blocks and long-lived
+ * large ones tend to end up in different parts of the heap and do not
+ * pin each other's free space.  The wilderness is always carved from
+ * the low end, so that what is left of it stays the last block.
+ * Returns the allocated block.
+ */
+static void *split_and_allocate_block(void *bp, size_t asize) {
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t rest = size - asize;
+    bool wild = bp == arena->wilderness;
+
+    remove_free_block(bp);
+    if (rest < MIN_SPLIT_SIZE) {
+        write_block(bp, size, 1); // Mark the whole block as allocated
+        return bp;
+    }
+    if (asize >= HIGH_PLACEMENT_SIZE && !wild) {
+        // Write the allocated block first: insert_free_block reads the next header
+        write_block((char*)bp + rest, asize, 1);
+        write_block(bp, rest, 0);
+        insert_free_block(bp);
+        bp = (char*)bp + rest;
+    } else {
+        write_block(bp, asize, 1);
+        write_block((char*)bp + asize, rest, 0);
+        insert_free_block((char*)bp + asize);
+    }
+    return bp;
+}
+
+/*
+ * split_tail - shrink the allocated block bp to asize bytes if the
+ * tail is worth splitting off, and free the tail (coalescing it with
+ * a free successor).
+ */
+static void split_tail(void *bp, size_t asize) {
+    size_t rest = GET_SIZE(HDRP(bp)) - asize;
+
+    if (rest < MIN_SPLIT_SIZE)
+        return;
+    write_block(bp, asize, 1);
+    write_block((char*)bp + asize, rest, 0);
+    coalesce((char*)bp + asize);
+}
+
+/*
+ * resize_in_place - try to make the allocated block bp asize bytes
+ * without moving it.  Returns false if the block cannot grow in place.
+ * The last block grows the heap only while it stays below MAP_MIN_SIZE.
+ */
+static bool resize_in_place(void *bp, size_t asize) {
+    size_t avail = GET_SIZE(HDRP(bp));
+    char *next = NEXT_BLKP(bp);
+    char *after = next;
+
+    if (asize <= avail) {
+        split_tail(bp, asize);
+        return true;
+    }
+    if (!GET_ALLOC(HDRP(next))) {
+        avail += GET_SIZE(HDRP(next));
+        after = NEXT_BLKP(next);
+    }
+    if (avail < asize && GET_SIZE(HDRP(after)) != 0)
+        return false; // not enough room, and not at the end of the heap
+    if (avail < asize && asize >= MAP_MIN_SIZE)
+        return false; // the caller maps blocks this large
+    if (avail < asize) {
+        // Last block of the heap: grow the heap by the shortfall only
+        if (mm_arena_sbrk(arena->id, asize - avail) == (void*)-1)
+            return false;
+        PUT((char*)bp + asize - HEADER_SIZE, PACK(0, 1)); // new epilogue
+        avail = asize;
+    }
+    if (next != after)
+        remove_free_block(next);
+    write_block(bp, avail, 1);
+    split_tail(bp, asize);
+    return true;
+}
+
+/*
+ * remap_realloc - move the large block ptr to a new block of size
+ * bytes.  Pages can only be remapped to the same offset within a page,
+ * so the new payload is placed at the same page offset as the old one:
+ * we take a block one page larger than needed, free the few bytes in
+ * front of the payload and split off the rest.  The whole pages of the
+ * payload are then moved with mm_remap and only the partial pages at
+ * either end are copied.
+ */
+static void *remap_realloc(void *ptr, size_t size) {
+    size_t page = mm_pagesize();
+    size_t asize = adjusted_size(size);
+    size_t copySize = payload_size(ptr);
+    size_t lead, total;
+    char *bp, *lo, *hi;
+
+    if ((bp = find_fit(asize + page)) == NULL) {
+        if ((bp = expand_heap(asize + page)) == NULL)
+            return NULL;
+    }
+    bp = split_and_allocate_block(bp, asize + page);
+    lead = ((uintptr_t)ptr - (uintptr_t)bp) & (page - 1);
+    if (lead != 0) {
+        // lead is a multiple of ALIGNMENT, so it always forms a valid block
+        total = GET_SIZE(HDRP(bp));
+        write_block(bp, lead, 0);
+        write_block(bp + lead, total - lead, 1);
+        coalesce(bp);
+        bp += lead;
+    }
+    split_tail(bp, asize);
+
+    if (size < copySize)
+        copySize = size;
+    lo = (char*)(((uintptr_t)ptr + page - 1) & ~(uintptr_t)(page - 1));
+    hi = (char*)(((uintptr_t)ptr + copySize) & ~(uintptr_t)(page - 1));
+    if (hi > lo && mm_remap(bp + (lo - (char*)ptr), lo, hi - lo) != NULL) {
+        memcpy(bp, ptr, lo - (char*)ptr);
+        memcpy(bp + (hi - (char*)ptr), hi, (char*)ptr + copySize - hi);
+    } else {
+        memcpy(bp, ptr, copySize);
+    }
+    arena_free(ptr);
+    return bp;
+}
+
+/*
+ * The expand_heap function is designed to increase the heap size dynamically
+ * when the memory allocator cannot find a suitable block of memory to satisfy
+ * an allocation request. Unlike the extend_heap function, which was called
+ * during the initialization of the memory management system to set up an initial
+ * heap size or in specific scenarios where a significant heap extension is needed,
+ * expand_heap is directly tied to the allocator's runtime operations.
+*/
+
+// Function to expand the heap so that the wilderness holds at least size bytes.
+// Returns a pointer to the new wilderness block or NULL if the allocation fails.
+static void *expand_heap(size_t size) {
+    char *tail = arena->wilderness;
+    size_t chunk = CHUNK_PAGES * mm_pagesize();
+    size_t heap = (char *)mm_arena_hi(arena->id) + 1 - (char *)mm_arena_lo(arena->id);
+    uintptr_t end;
+    char *bp;
+
+    size = align(size);
+    if (tail != NULL && GET_SIZE(HDRP(tail)) < size) {
+        // The wilderness covers part of the request: add the shortfall
+        size -= GET_SIZE(HDRP(tail));
+    } else if (heap >= CHUNK_MIN_HEAP) {
+        // Grow by a whole chunk, and end the heap on a page boundary
+        size = size > chunk ? size : chunk;
+        end = (uintptr_t)mm_arena_hi(arena->id) + 1 + size;
+        size += (chunk - end % chunk) % chunk;
+    }
+
+    // Request more memory from the OS
+    if ((bp = mm_arena_sbrk(arena->id, size)) == (void*)-1) {
+        return NULL; // Failed to allocate more memory
+    }
+
+    // Create a new epilogue header after the new block
+    PUT(bp + size - HEADER_SIZE, PACK(0, 1)); // Size 0, marked as allocated
+
+    // The old epilogue header becomes the header of the new block.
+    // The size is already aligned, and we mark it as free (0).
+    write_block(bp, size, 0);
+
+    // Merge with a free tail block and put the result on its list
+    return coalesce(bp);
 }
 
 static bool checkblock(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+
     // Ensure alignment
-    if ((size_t)bp % ALIGNMENT != 0) {
+    if (!aligned(bp)) {
         printf("Error: %p is not aligned\n", bp);
         return false;
     }
 
-    // Check if the header matches the footer
-    if (GET(HDRP(bp)) != GET(FTRP(bp))) {
-        printf("Error: header does not match footer\n");
+    if (!in_heap(HDRP(bp)) || !in_heap((char *)bp + size - HEADER_SIZE - 1)) {
+        printf("Error: %p lies outside the heap\n", bp);
+        return false;
+    }
+
+    // Mini blocks are the only blocks below the minimum size, and have no footer
+    if (size == MINI_BLOCK_SIZE)
+        return true;
+    if (size < MIN_BLOCK_SIZE) {
+        printf("Error: %p is smaller than the minimum block size\n", bp);
         return false;
     }
 
-    // Add more checks here as needed
+    // Allocated blocks have no footer; their payload covers that word
+    if (GET_ALLOC(HDRP(bp)))
+        return true;
+
+    // Check if the header matches the footer (the footer has no prev bits)
+    if (PACK(GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp))) != GET(FTRP(bp))) {
+        printf("Error: header does not match footer\n");
+        return false;
+    }
 
     // If all checks passed, return true
     return true;
 }
 
+/*
+ * checkfreelists - every list node is a free block of the right size
+ * class, the links are consistent in both directions, the bitmaps
+ * match the lists, and the lists together hold as many blocks as the
+ * heap walk found free.
+ */
+static bool checkfreelists(int line, size_t heap_free_blocks) {
+    size_t list_free_blocks = 0;
+    int cls, fl, sl;
+    char *bp, *prev;
+
+    for (cls = 0; cls < FL_COUNT * SL_COUNT; cls++) {
+        int list_fl = cls / SL_COUNT, list_sl = cls % SL_COUNT;
+        bool bit_set = (arena->sl_bitmap[list_fl] >> list_sl) & 1;
+
+        if (bit_set != (arena->heads[list_fl][list_sl] != NULL)) {
+            printf("Bitmap bit of free list %d does not match the list at line %d\n", cls, line);
+            return false;
+        }
+        if (((arena->fl_bitmap >> list_fl) & 1) != (arena->sl_bitmap[list_fl] != 0)) {
+            printf("First-level bitmap bit %d is wrong at line %d\n", list_fl, line);
+            return false;
+        }
+        prev = NULL;
+        for (bp = arena->heads[list_fl][list_sl]; bp != NULL; bp = NEXT_FREE(bp)) {
+            if (!in_heap(bp) || !aligned(bp)) {
+                printf("Free list %d points outside the heap (%p) at line %d\n", cls, bp, line);
+                return false;
+            }
+            if (GET_ALLOC(HDRP(bp))) {
+                printblock(bp);
+                printf("Allocated block on free list %d at line %d\n", cls, line);
+                return false;
+            }
+            mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+            if (fl != list_fl || sl != list_sl) {
+                printblock(bp);
+                printf("Block on wrong free list %d at line %d\n", cls, line);
+                return false;
+            }
+            if (PREV_FREE(bp) != prev) {
+                printblock(bp);
+                printf("Broken prev link on free list %d at line %d\n", cls, line);
+                return false;
+            }
+            prev = bp;
+            if (++list_free_blocks > heap_free_blocks) {
+                printf("Free lists hold more blocks than the heap at line %d\n", line);
+                return false;
+            }
+        }
+    }
+    prev = NULL;
+    for (bp = arena->mini_head; bp != NULL; bp = MINI_NEXT(bp)) {
+        if (!in_heap(bp) || !aligned(bp)) {
+            printf("Mini free list points outside the heap (%p) at line %d\n", bp, line);
+            return false;
+        }
+        if (MINI_PREV(bp) != prev) {
+            printblock(bp);
+            printf("Broken prev link on the mini free list at line %d\n", line);
+            return false;
+        }
+        prev = bp;
+        if (GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) != MINI_BLOCK_SIZE) {
+            printblock(bp);
+            printf("Bad block on the mini free list at line %d\n", line);
+            return false;
+        }
+        if (++list_free_blocks > heap_free_blocks) {
+            printf("Free lists hold more blocks than the heap at line %d\n", line);
+            return false;
+        }
+    }
+    if (!checktree(line, &list_free_blocks) || !checkdecay(line))
+        return false;
+    bp = arena->wilderness;
+    if (bp != NULL) {
+        if (!in_heap(bp) || GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(NEXT_BLKP(bp))) != 0) {
+            printf("Wilderness %p is not a free block at the end of the heap at line %d\n", bp, line);
+            return false;
+        }
+        list_free_blocks++;
+    }
+    if (list_free_blocks != heap_free_blocks) {
+        printf("Free lists hold %zu blocks but the heap has %zu at line %d\n",
+               list_free_blocks, heap_free_blocks, line);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * checktree - walk the splay tree in order, following parent links
+ * back up, so that a broken parent link is caught as well.  Every node
+ * must be a large free block, and the keys must strictly increase.
+ * The nodes are added to *tree_blocks.
+ */
+static bool checktree(int line, size_t *tree_blocks) {
+    char *bp = arena->tree_root;
+    char *last = NULL, *child;
+
+    if (bp != NULL && TREE_PARENT(bp) != NULL) {
+        printf("Splay tree root has a parent at line %d\n", line);
+        return false;
+    }
+    while (bp != NULL && TREE_LEFT(bp) != NULL)
+        bp = TREE_LEFT(bp);
+    while (bp != NULL) {
+        if (!in_heap(bp) || !aligned(bp)) {
+            printf("Splay tree points outside the heap (%p) at line %d\n", bp, line);
+            return false;
+        }
+        if (GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < TREE_MIN_SIZE) {
+            printblock(bp);
+            printf("Bad block in the splay tree at line %d\n", line);
+            return false;
+        }
+        if (last != NULL && !tree_key_less(last, bp)) {
+            printblock(bp);
+            printf("Splay tree out of order at line %d\n", line);
+            return false;
+        }
+        if ((TREE_LEFT(bp) && TREE_PARENT(TREE_LEFT(bp)) != bp) ||
+            (TREE_RIGHT(bp) && TREE_PARENT(TREE_RIGHT(bp)) != bp)) {
+            printblock(bp);
+            printf("Broken parent link in the splay tree at line %d\n", line);
+            return false;
+        }
+        last = bp;
+        (*tree_blocks)++;
+        if (TREE_RIGHT(bp) != NULL) {
+            for (bp = TREE_RIGHT(bp); TREE_LEFT(bp) != NULL; bp = TREE_LEFT(bp))
+                ;
+        } else {
+            do {
+                child = bp;
+                bp = TREE_PARENT(bp);
+            } while (bp != NULL && TREE_RIGHT(bp) == child);
+        }
+    }
+    return true;
+}
+
+/*
+ * checkdecay - the decay list must hold exactly the unpurged tree
+ * blocks, oldest first, with matching back links.
+ */
+static bool checkdecay(int line) {
+    size_t listed = 0, unpurged = 0;
+    char *bp, *prev = NULL;
+
+    for (bp = arena->decay_head; bp != NULL; prev = bp, bp = DECAY_NEXT(bp)) {
+        if (!in_heap(bp) || GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < TREE_MIN_SIZE ||
+            IS_PURGED(bp) || DECAY_PREV(bp) != prev) {
+            printf("Bad block %p on the decay list at line %d\n", bp, line);
+            return false;
+        }
+        if (prev != NULL && FREED_AT(bp) < FREED_AT(prev)) {
+            printf("Decay list out of order at line %d\n", line);
+            return false;
+        }
+        listed++;
+    }
+    if (prev != arena->decay_tail) {
+        printf("Decay list tail is wrong at line %d\n", line);
+        return false;
+    }
+    bp = arena->tree_root;
+    while (bp != NULL && TREE_LEFT(bp) != NULL)
+        bp = TREE_LEFT(bp);
+    for (; bp != NULL; bp = tree_next(bp))
+        unpurged += !IS_PURGED(bp);
+    if (listed != unpurged) {
+        printf("Decay list holds %zu blocks but the tree has %zu unpurged at line %d\n",
+               listed, unpurged, line);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * checkquicklists - every cached block must be an allocated heap block
+ * of its list's size, and each list must hold as many blocks as its
+ * count says.
+ */
+static bool checkquicklists(int line) {
+    int i, count;
+    char *bp;
+
+    for (i = 0; i < QUICK_COUNT; i++) {
+        count = 0;
+        for (bp = arena->quick_heads[i]; bp != NULL; bp = NEXT_FREE(bp)) {
+            if (!in_heap(bp) || !aligned(bp)) {
+                printf("Quick list %d points outside the heap (%p) at line %d\n", i, bp, line);
+                return false;
+            }
+            if (!GET_ALLOC(HDRP(bp)) || CLASS_INDEX(GET_SIZE(HDRP(bp))) != i) {
+                printblock(bp);
+                printf("Bad block on quick list %d at line %d\n", i, line);
+                return false;
+            }
+            if (++count > QUICK_LIMIT) {
+                printf("Quick list %d is over its limit at line %d\n", i, line);
+                return false;
+            }
+        }
+        if (count != arena->quick_counts[i]) {
+            printf("Quick list %d holds %d blocks, its count says %d at line %d\n",
+                   i, count, arena->quick_counts[i], line);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * checkremote - every block on the locked arena's remote free queue
+ * must be an allocated block of the arena.  Other threads may push
+ * while we look, but only in front of the head we started from.
+ */
+static bool checkremote(int line) {
+    char *bp = __atomic_load_n(&arena->remote_head, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+
+    for (; bp != NULL; bp = NEXT_FREE(bp)) {
+        if (!in_heap(bp) || !aligned(bp)) {
+            printf("Remote free queue points outside the arena (%p) at line %d\n", bp, line);
+            return false;
+        }
+        if (!GET_ALLOC(HDRP(bp))) {
+            printblock(bp);
+            printf("Free block on the remote free queue at line %d\n", line);
+            return false;
+        }
+        if (++count > mm_heapsize() / MIN_BLOCK_SIZE) {
+            printf("Remote free queue has a cycle at line %d\n", line);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * checkcache - every block in the calling thread's cache in ctx must be
+ * an allocated block of its list's size in some arena, and each list
+ * must hold as many blocks as its count says.  Other threads may be
+ * changing the CPU caches, so of those we only check the counts.
+ */
+static bool checkcache(mm_ctx_t *ctx, int line) {
+    thread_cache_t *cache;
+    int i, cpu, count;
+    long cpu_count;
+    char *bp;
+
+    for (cpu = 0; ctx->cpu_caches != NULL && cpu < ctx->cpu_count; cpu++) {
+        for (i = 0; i < CACHE_COUNT; i++) {
+            cpu_count = __atomic_load_n(&ctx->cpu_caches[cpu].lists[i].count, __ATOMIC_RELAXED);
+            if (cpu_count < 0 || cpu_count > CPU_CACHE_LIMIT) {
+                printf("CPU %d cache list %d holds %ld blocks at line %d\n", cpu, i, cpu_count, line);
+                return false;
+            }
+        }
+    }
+    if (tstate_serial != ctx->serial || (cache = tstate->cache) == NULL)
+        return true;
+    for (i = 0; i < CACHE_COUNT; i++) {
+        count = 0;
+        for (bp = cache->heads[i]; bp != NULL; bp = NEXT_FREE(bp)) {
+            if (mm_arena_of(bp) < 0 || !aligned(bp)) {
+                printf("Thread cache list %d points outside the arenas (%p) at line %d\n", i, bp, line);
+                return false;
+            }
+            if (!GET_ALLOC(HDRP(bp)) || CLASS_INDEX(GET_SIZE(HDRP(bp))) != i) {
+                printblock(bp);
+                printf("Bad block on thread cache list %d at line %d\n", i, line);
+                return false;
+            }
+            if (++count > CACHE_LIMIT) {
+                printf("Thread cache list %d is over its limit at line %d\n", i, line);
+                return false;
+            }
+        }
+        if (count != cache->counts[i]) {
+            printf("Thread cache list %d holds %d blocks, its count says %d at line %d\n",
+                   i, count, cache->counts[i], line);
+            return false;
+        }
+    }
+    return true;
+}
+
 static void printblock(void *bp) {
     size_t hsize, halloc;
 
@@ -401,5 +2565,6 @@ static void printblock(void *bp) {
         return;
     }
 
-    printf("%p: header: [%zu:%c]\n", bp, hsize, (halloc ? 'A' : 'F'));
+    printf("%p: header: [%zu:%c] prev: [%c%s]\n", bp, hsize, (halloc ? 'A' : 'F'),
+           (GET_PREV_ALLOC(HDRP(bp)) ? 'A' : 'F'), (GET_PREV_MINI(HDRP(bp)) ? ":mini" : ""));
 }
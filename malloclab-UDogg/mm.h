@@ -21,5 +21,30 @@ extern void* calloc (size_t nmemb, size_t size);
 
 extern bool mm_init(void);
 
+/* A reentrant allocator context on a range of empty memlib arena
+   regions.  The functions above work on a default context over all of
+   them, which mm_init makes.  mm_ctx_init takes the id of the first
+   region, then how many regions from there, all of which must exist:
+   a context on one region r of its own is
+   mm_ctx_init(mem_region_id(r), 1, false). */
+typedef struct mm_ctx mm_ctx_t;
+
+extern mm_ctx_t* mm_ctx_init(int first_region, int regions, bool percpu);
+extern void mm_ctx_destroy(mm_ctx_t* ctx);
+extern void* mm_ctx_malloc(mm_ctx_t* ctx, size_t size);
+extern void mm_ctx_free(mm_ctx_t* ctx, void* ptr);
+extern void* mm_ctx_realloc(mm_ctx_t* ctx, void* ptr, size_t size);
+extern void* mm_ctx_calloc(mm_ctx_t* ctx, size_t nmemb, size_t size);
+extern bool mm_ctx_checkheap(mm_ctx_t* ctx, int line_number);
+
+/* Give the free space at the end of the heap back to the system,
+   keeping pad bytes of it.  Returns whether anything was released. */
+extern bool mm_trim(size_t pad);
+extern bool mm_ctx_trim(mm_ctx_t* ctx, size_t pad);
+
+/* Use per-CPU instead of per-thread caches from the next mm_init on.
+   Returns whether the calling thread can (it needs Linux rseq). */
+extern bool mm_percpu_caches(bool enable);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int line_number);
@@ -0,0 +1,579 @@
+/*
+ * mmtest - checks the parts of mm and memlib that mdriver does not
+ * drive: many threads at once, contexts, regions of their own, mapped
+ * extents, trimming and prefaulting a heap that is already in use.
+ *
+ * Usage: mmtest
+ *
+ * STRESS_THREADS threads malloc, realloc and free blocks at once, each
+ * block filled with a pattern of its own.  Threads hand blocks to each
+ * other through a shared pool, so many blocks are freed by a thread
+ * other than the one that allocated them.  Every block is checked
+ * before it is resized or freed, and every block still live after the
+ * threads are joined is checked too, as is the heap.  The test runs
+ * again with per-CPU caches and PERCPU_THREADS threads per CPU, so that
+ * threads are preempted and migrated inside the caches' restartable
+ * sequences.
+ *
+ * REMOTE_THREADS threads free the blocks of another thread's arena,
+ * which go back through its remote free queue.  Once the owner drains
+ * the queue, the heap must check out, and allocating as many blocks
+ * again must neither grow the heap nor hand out a block twice.
+ *
+ * Two contexts split the arena regions of the heap between them, and
+ * their blocks must not overlap.
+ *
+ * Two more contexts get a region each, next to the default context on
+ * the heap.  Each allocates small and mapped blocks filled with a
+ * pattern of its own; one is reset, and the blocks of the others must
+ * come through unchanged.  Trimming a context must shrink its region
+ * and leave every live block alone.
+ *
+ * Requests around the size at which mm maps an extent instead of
+ * growing the heap must all be served, by malloc and by realloc, and
+ * growing the last block of the heap to that size must not grow the
+ * heap.
+ *
+ * Turning prefaulting on once the heap holds data must not touch that
+ * data.  Prints each failed check and exits with 1 if there were any.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define SMALL_BLOCKS 1000           /* small blocks per context */
+#define SMALL_SIZE   48             /* ... and their size */
+#define BIG_SIZE     (1024 * 1024)  /* a size that gets a mapped extent */
+#define MAP_SIZE     (128 * 1024)   /* mm.c's MAP_MIN_SIZE, where extents start */
+#define MAP_SPAN     64             /* bytes either side of it to try */
+#define HEAP_SIZE    (100 * 1000)   /* a size that grows the heap */
+#define STRESS_THREADS 8            /* threads in the stress test */
+#define STRESS_OPS   20000          /* operations per thread */
+#define STRESS_LIVE  64             /* blocks a thread holds at most */
+#define POOL_SIZE    256            /* blocks the threads hand each other */
+#define PERCPU_THREADS 4            /* stress threads per CPU with per-CPU caches */
+#define REMOTE_THREADS 3            /* threads freeing another arena's blocks */
+#define REMOTE_BLOCKS 3000          /* blocks they free */
+#define REMOTE_SIZE  512            /* ... and their size, too large for the caches */
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, int line) {
+    if (!ok) {
+        fprintf(stderr, "mmtest: line %d: %s\n", line, what);
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* A context's blocks, each filled with its own pattern */
+typedef struct {
+    mm_ctx_t *ctx;              /* NULL for the default context */
+    unsigned char pattern;
+    unsigned char *small[SMALL_BLOCKS];
+    unsigned char *big;
+} heap_t;
+
+static void *heap_malloc(heap_t *h, size_t size) {
+    return h->ctx != NULL ? mm_ctx_malloc(h->ctx, size) : mm_malloc(size);
+}
+
+static void heap_free(heap_t *h, void *p) {
+    if (h->ctx != NULL)
+        mm_ctx_free(h->ctx, p);
+    else
+        mm_free(p);
+}
+
+/* fill - allocate h's blocks and fill them with its pattern */
+static void fill(heap_t *h) {
+    int i;
+
+    for (i = 0; i < SMALL_BLOCKS; i++) {
+        h->small[i] = heap_malloc(h, SMALL_SIZE);
+        check(h->small[i] != NULL, "small malloc failed", __LINE__);
+        if (h->small[i] != NULL)
+            memset(h->small[i], h->pattern, SMALL_SIZE);
+    }
+    h->big = heap_malloc(h, BIG_SIZE);
+    check(h->big != NULL, "mapped malloc failed", __LINE__);
+    if (h->big != NULL)
+        memset(h->big, h->pattern, BIG_SIZE);
+}
+
+/* empty - free h's small blocks */
+static void empty(heap_t *h) {
+    int i;
+
+    for (i = 0; i < SMALL_BLOCKS; i++) {
+        heap_free(h, h->small[i]);
+        h->small[i] = NULL;
+    }
+}
+
+/* intact - whether h's live blocks all still hold its pattern */
+static bool intact(const heap_t *h) {
+    size_t j;
+    int i;
+
+    for (i = 0; i < SMALL_BLOCKS; i++) {
+        for (j = 0; h->small[i] != NULL && j < SMALL_SIZE; j++) {
+            if (h->small[i][j] != h->pattern)
+                return false;
+        }
+    }
+    for (j = 0; h->big != NULL && j < BIG_SIZE; j++) {
+        if (h->big[j] != h->pattern)
+            return false;
+    }
+    return true;
+}
+
+/* A block of the stress test: its payload, size and fill byte */
+typedef struct {
+    unsigned char *p;
+    size_t size;
+    unsigned char pattern;
+} block_t;
+
+static block_t pool[POOL_SIZE];     /* blocks on their way to another thread */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* block_intact - whether b still holds its pattern */
+static bool block_intact(const block_t *b) {
+    size_t j;
+
+    for (j = 0; j < b->size; j++) {
+        if (b->p[j] != b->pattern)
+            return false;
+    }
+    return true;
+}
+
+/* stress_size - mostly small sizes, some medium, a few mapped */
+static size_t stress_size(unsigned *seed) {
+    int r = rand_r(seed) % 100;
+
+    if (r < 70)
+        return 1 + rand_r(seed) % 256;
+    if (r < 98)
+        return 257 + rand_r(seed) % 8192;
+    return MAP_SIZE + rand_r(seed) % MAP_SIZE;
+}
+
+/*
+ * stress - one thread of the stress test: malloc, realloc and free its
+ * own blocks, and swap blocks with the shared pool, so that it frees
+ * blocks of other threads too
+ */
+static void *stress(void *arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    block_t live[STRESS_LIVE];
+    block_t b, mine;
+    int n = 0, op, k, slot;
+
+    for (op = 0; op < STRESS_OPS; op++) {
+        k = n > 0 ? rand_r(&seed) % n : 0;
+        switch (rand_r(&seed) % 4) {
+        case 0:
+            if (n == STRESS_LIVE)
+                break;
+            b.size = stress_size(&seed);
+            b.pattern = (unsigned char)(1 + rand_r(&seed) % 255);
+            if ((b.p = mm_malloc(b.size)) == NULL) {
+                check(false, "malloc failed in a thread", __LINE__);
+                break;
+            }
+            memset(b.p, b.pattern, b.size);
+            live[n++] = b;
+            break;
+        case 1:
+            if (n == 0)
+                break;
+            check(block_intact(&live[k]), "block changed before realloc", __LINE__);
+            b.size = stress_size(&seed);
+            b.p = mm_realloc(live[k].p, b.size);
+            if (b.p == NULL) {
+                check(false, "realloc failed in a thread", __LINE__);
+                break;
+            }
+            live[k].p = b.p;
+            if (b.size < live[k].size)
+                live[k].size = b.size;
+            check(block_intact(&live[k]), "realloc lost the payload", __LINE__);
+            live[k].size = b.size;
+            memset(b.p, live[k].pattern, b.size);
+            break;
+        case 2:
+            if (n == 0)
+                break;
+            check(block_intact(&live[k]), "block changed before free", __LINE__);
+            mm_free(live[k].p);
+            live[k] = live[--n];
+            break;
+        default:
+            /* Swap one of ours, or nothing, for whatever is in a pool slot */
+            slot = rand_r(&seed) % POOL_SIZE;
+            mine.p = NULL;
+            if (n > 0) {
+                mine = live[k];
+                live[k] = live[--n];
+            }
+            pthread_mutex_lock(&pool_lock);
+            b = pool[slot];
+            pool[slot] = mine;
+            pthread_mutex_unlock(&pool_lock);
+            if (b.p != NULL) {
+                check(block_intact(&b), "block changed in the pool", __LINE__);
+                live[n++] = b;
+            }
+            break;
+        }
+    }
+    /* Leave half of what is left for the others, free the rest */
+    for (k = 0; k < n; k++) {
+        check(block_intact(&live[k]), "block changed before the last free", __LINE__);
+        if (k % 2 == 0) {
+            mm_free(live[k].p);
+            continue;
+        }
+        pthread_mutex_lock(&pool_lock);
+        for (slot = 0; slot < POOL_SIZE && pool[slot].p != NULL; slot++)
+            ;
+        if (slot < POOL_SIZE)
+            pool[slot] = live[k];
+        pthread_mutex_unlock(&pool_lock);
+        if (slot == POOL_SIZE)
+            mm_free(live[k].p);
+    }
+    return NULL;
+}
+
+/* run_stress - run threads stress threads on the default context */
+static void run_stress(int threads) {
+    pthread_t tids[threads];
+    int i;
+
+    memset(pool, 0, sizeof(pool));
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, stress, (void *)(uintptr_t)(i + 1)) != 0) {
+            check(false, "pthread_create failed", __LINE__);
+            threads = i;
+        }
+    }
+    for (i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    check(mm_checkheap(__LINE__), "heap check failed after the threads", __LINE__);
+    for (i = 0; i < POOL_SIZE; i++) {
+        if (pool[i].p == NULL)
+            continue;
+        check(block_intact(&pool[i]), "block changed after the threads", __LINE__);
+        mm_free(pool[i].p);
+        pool[i].p = NULL;
+    }
+    check(mm_checkheap(__LINE__), "heap check failed after the last frees", __LINE__);
+}
+
+/* test_threads - STRESS_THREADS threads on the default context */
+static void test_threads(void) {
+    mem_init();
+    check(mm_init(), "mm_init failed", __LINE__);
+    run_stress(STRESS_THREADS);
+    mem_deinit();
+}
+
+/* test_percpu - more stress threads than CPUs, on per-CPU caches */
+static void test_percpu(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = PERCPU_THREADS * (cpus > 0 ? cpus : 1);
+
+    if (!mm_percpu_caches(true))
+        printf("mmtest: no rseq, so threads keep per-thread caches\n");
+    if (threads < STRESS_THREADS)
+        threads = STRESS_THREADS;
+    mem_init();
+    check(mm_init(), "mm_init failed", __LINE__);
+    run_stress(threads);
+    mem_deinit();
+    mm_percpu_caches(false);
+}
+
+static unsigned char *remote[REMOTE_BLOCKS];
+
+/* remote_free - free every REMOTE_THREADS-th block of remote[], from arg on */
+static void *remote_free(void *arg) {
+    int i;
+
+    for (i = (int)(uintptr_t)arg; i < REMOTE_BLOCKS; i += REMOTE_THREADS)
+        mm_free(remote[i]);
+    return NULL;
+}
+
+static int by_address(const void *a, const void *b) {
+    const unsigned char *x = *(unsigned char * const *)a;
+    const unsigned char *y = *(unsigned char * const *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* test_remote - free one arena's blocks from other threads, then reuse them */
+static void test_remote(void) {
+    pthread_t tids[REMOTE_THREADS];
+    size_t heap;
+    int i;
+
+    mem_init();
+    check(mm_init(), "mm_init failed", __LINE__);
+    for (i = 0; i < REMOTE_BLOCKS; i++) {
+        remote[i] = mm_malloc(REMOTE_SIZE);
+        check(remote[i] != NULL, "malloc failed", __LINE__);
+    }
+    for (i = 0; i < REMOTE_THREADS; i++)
+        pthread_create(&tids[i], NULL, remote_free, (void *)(uintptr_t)i);
+    for (i = 0; i < REMOTE_THREADS; i++)
+        pthread_join(tids[i], NULL);
+    check(mm_checkheap(__LINE__), "heap check failed with queued frees", __LINE__);
+
+    /* The first malloc drains the queue; the rest reuse what it freed */
+    heap = mm_heapsize();
+    remote[0] = mm_malloc(REMOTE_SIZE);
+    check(mm_checkheap(__LINE__), "heap check failed after the drain", __LINE__);
+    for (i = 1; i < REMOTE_BLOCKS; i++)
+        remote[i] = mm_malloc(REMOTE_SIZE);
+    check(mm_heapsize() == heap, "remotely freed blocks were not reused", __LINE__);
+    qsort(remote, REMOTE_BLOCKS, sizeof(remote[0]), by_address);
+    for (i = 0; i < REMOTE_BLOCKS; i++) {
+        check(remote[i] != NULL, "malloc failed after the drain", __LINE__);
+        check(i == 0 || remote[i - 1] == NULL || remote[i - 1] + REMOTE_SIZE <= remote[i],
+              "a block was handed out twice", __LINE__);
+    }
+    mem_deinit();
+}
+
+/* test_contexts - two contexts on the arena regions of the heap */
+static void test_contexts(void) {
+    int half = mm_arena_count() / 2;
+    heap_t h1 = { NULL, 0x22, { NULL }, NULL };
+    heap_t h2 = { NULL, 0x33, { NULL }, NULL };
+
+    mem_init();
+    h1.ctx = mm_ctx_init(0, half, false);
+    h2.ctx = mm_ctx_init(half, mm_arena_count() - half, false);
+    check(h1.ctx != NULL && h2.ctx != NULL, "mm_ctx_init failed", __LINE__);
+    if (h1.ctx == NULL || h2.ctx == NULL)
+        return;
+    check(mm_ctx_init(0, 1, false) == NULL, "mm_ctx_init took a region that is in use", __LINE__);
+
+    fill(&h1);
+    fill(&h2);
+    check(mm_arena_of(h1.small[0]) < half && mm_arena_of(h2.small[0]) >= half,
+          "blocks came from the wrong context", __LINE__);
+    check(mm_ctx_checkheap(h1.ctx, __LINE__) && mm_ctx_checkheap(h2.ctx, __LINE__),
+          "heap check failed", __LINE__);
+    check(intact(&h1) && intact(&h2), "blocks overlap", __LINE__);
+
+    /* Churn one context: the other must not notice */
+    empty(&h1);
+    heap_free(&h1, h1.big);
+    fill(&h1);
+    check(intact(&h1) && intact(&h2), "blocks overlap after a refill", __LINE__);
+    check(mm_ctx_checkheap(h1.ctx, __LINE__) && mm_ctx_checkheap(h2.ctx, __LINE__),
+          "heap check failed after a refill", __LINE__);
+
+    mm_ctx_destroy(h1.ctx);
+    mm_ctx_destroy(h2.ctx);
+    mem_deinit();
+}
+
+/* test_regions - two contexts on regions of their own, and the default one */
+static void test_regions(void) {
+    mem_region_t *r1, *r2;
+    heap_t h0 = { NULL, 0x11, { NULL }, NULL };
+    heap_t h1 = { NULL, 0x22, { NULL }, NULL };
+    heap_t h2 = { NULL, 0x33, { NULL }, NULL };
+    size_t mapped;
+
+    mem_init();
+    check(mm_init(), "mm_init failed", __LINE__);
+    r1 = mem_region_create(0);
+    r2 = mem_region_create(0);
+    check(r1 != NULL && r2 != NULL, "mem_region_create failed", __LINE__);
+    if (r1 == NULL || r2 == NULL)
+        return;
+
+    /* The first region's id, then how many regions from there */
+    h1.ctx = mm_ctx_init(mem_region_id(r1), 1, false);
+    h2.ctx = mm_ctx_init(mem_region_id(r2), 1, false);
+    check(h1.ctx != NULL && h2.ctx != NULL, "mm_ctx_init failed", __LINE__);
+    if (h1.ctx == NULL || h2.ctx == NULL)
+        return;
+    check(mm_ctx_init(mem_region_id(r1), 1, false) == NULL,
+          "mm_ctx_init took a region that is in use", __LINE__);
+
+    fill(&h0);
+    fill(&h1);
+    fill(&h2);
+    check(mem_region_of(h1.small[0]) == r1 && mem_region_of(h2.small[0]) == r2,
+          "blocks came from the wrong region", __LINE__);
+    check(mm_checkheap(__LINE__) && mm_ctx_checkheap(h1.ctx, __LINE__) &&
+          mm_ctx_checkheap(h2.ctx, __LINE__), "heap check failed", __LINE__);
+    check(intact(&h0) && intact(&h1) && intact(&h2), "blocks overlap", __LINE__);
+
+    /* Reset the first context's region: only its extent may go */
+    mapped = mm_mapsize();
+    mm_ctx_destroy(h1.ctx);
+    mem_region_reset_brk(r1);
+    memset(h1.small, 0, sizeof(h1.small));
+    h1.big = NULL;
+    check(mem_region_size(r1) == 0, "mem_region_reset_brk left bytes in use", __LINE__);
+    check(mm_mapsize() < mapped, "mem_region_reset_brk kept its extent", __LINE__);
+    check(mm_mapsize() > 0, "mem_region_reset_brk unmapped other extents", __LINE__);
+    check(intact(&h0) && intact(&h2), "resetting a region touched other heaps", __LINE__);
+    check(mm_ctx_checkheap(h2.ctx, __LINE__), "heap check failed after reset", __LINE__);
+
+    /* A reset region takes a new context */
+    h1.ctx = mm_ctx_init(mem_region_id(r1), 1, false);
+    check(h1.ctx != NULL, "mm_ctx_init failed on a reset region", __LINE__);
+    if (h1.ctx != NULL) {
+        fill(&h1);
+        check(intact(&h1) && intact(&h2), "blocks overlap after the reset", __LINE__);
+        mm_ctx_destroy(h1.ctx);
+    }
+
+    /* Resetting the heap leaves the regions' contexts alone */
+    mem_reset_brk();
+    check(intact(&h2), "mem_reset_brk touched another region", __LINE__);
+    check(mm_ctx_checkheap(h2.ctx, __LINE__), "heap check failed after mem_reset_brk", __LINE__);
+
+    mm_ctx_destroy(h2.ctx);
+    mem_deinit();
+}
+
+/* test_map_boundary - every size near MAP_SIZE, on a fresh heap each */
+static void test_map_boundary(void) {
+    size_t size;
+    char *p, *q;
+
+    for (size = MAP_SIZE - MAP_SPAN; size <= MAP_SIZE + MAP_SPAN; size++) {
+        mem_init();
+        check(mm_init(), "mm_init failed", __LINE__);
+        p = mm_malloc(size);
+        check(p != NULL, "malloc failed near MAP_MIN_SIZE", __LINE__);
+        if (p != NULL)
+            memset(p, 0x44, size);
+        q = mm_realloc(mm_malloc(64), size);
+        check(q != NULL, "realloc up failed near MAP_MIN_SIZE", __LINE__);
+        mm_free(q);
+        q = mm_realloc(mm_malloc(BIG_SIZE), size);
+        check(q != NULL, "realloc down failed near MAP_MIN_SIZE", __LINE__);
+        mm_free(q);
+        mm_free(p);
+        check(mm_checkheap(__LINE__), "heap check failed near MAP_MIN_SIZE", __LINE__);
+        mem_deinit();
+    }
+}
+
+/* test_map_tail - a mapped-size realloc of the last block maps it */
+static void test_map_tail(void) {
+    size_t heap;
+    char *p;
+
+    mem_init();
+    check(mm_init(), "mm_init failed", __LINE__);
+    p = mm_malloc(1000);
+    check(p != NULL, "malloc failed", __LINE__);
+    heap = mm_heapsize();
+    p = mm_realloc(p, 2 * MAP_SIZE);
+    check(p != NULL, "realloc of the last block failed", __LINE__);
+    check(mm_heapsize() <= heap, "realloc of the last block grew the heap", __LINE__);
+    check(mm_mapsize() > 0, "realloc of the last block did not map it", __LINE__);
+    mm_free(p);
+    check(mm_checkheap(__LINE__), "heap check failed after a tail realloc", __LINE__);
+    mem_deinit();
+}
+
+/* test_trim - trim a context on a region of its own, then the default one */
+static void test_trim(void) {
+    mem_region_t *r;
+    heap_t h0 = { NULL, 0x11, { NULL }, NULL };
+    heap_t h1 = { NULL, 0x22, { NULL }, NULL };
+    size_t size;
+
+    mem_init();
+    check(mm_init(), "mm_init failed", __LINE__);
+    r = mem_region_create(0);
+    check(r != NULL, "mem_region_create failed", __LINE__);
+    if (r == NULL || (h1.ctx = mm_ctx_init(mem_region_id(r), 1, false)) == NULL) {
+        check(false, "mm_ctx_init failed", __LINE__);
+        return;
+    }
+    fill(&h0);
+    fill(&h1);
+
+    /* Free the context's small blocks and trim its region */
+    empty(&h1);
+    size = mem_region_size(r);
+    check(mm_ctx_trim(h1.ctx, 0), "mm_ctx_trim released nothing", __LINE__);
+    check(mem_region_size(r) < size, "mm_ctx_trim left the region as it was", __LINE__);
+    check(mm_ctx_checkheap(h1.ctx, __LINE__), "heap check failed after trim", __LINE__);
+    check(intact(&h0) && intact(&h1), "trim touched live blocks", __LINE__);
+    check(!mm_trim(0) || intact(&h0), "mm_trim touched live blocks", __LINE__);
+
+    /* Once its small blocks are gone, the default heap shrinks too */
+    empty(&h0);
+    size = mm_heapsize();
+    check(mm_trim(0), "mm_trim released nothing", __LINE__);
+    check(mm_heapsize() < size, "mm_trim left the heap as it was", __LINE__);
+    check(mm_checkheap(__LINE__) && intact(&h0), "heap check failed after mm_trim", __LINE__);
+
+    mm_ctx_destroy(h1.ctx);
+    mem_deinit();
+}
+
+/* test_prefault - prefaulting a heap that already holds data */
+static void test_prefault(void) {
+    unsigned char *p, *q;
+    size_t j;
+
+    mem_init();
+    check(mm_init(), "mm_init failed", __LINE__);
+    p = mm_malloc(HEAP_SIZE);
+    check(p != NULL, "malloc failed", __LINE__);
+    if (p == NULL)
+        return;
+    memset(p, 0x55, HEAP_SIZE);
+
+    /* The policy comes after the heap grew: the next growth faults ahead */
+    mem_set_policy(MEM_PREFAULT, 0);
+    q = mm_malloc(HEAP_SIZE);
+    check(q != NULL, "malloc failed under MEM_PREFAULT", __LINE__);
+    for (j = 0; j < HEAP_SIZE && p[j] == 0x55; j++)
+        ;
+    check(j == HEAP_SIZE, "prefaulting wrote into live blocks", __LINE__);
+    check(mm_checkheap(__LINE__), "heap check failed under MEM_PREFAULT", __LINE__);
+    mem_set_policy(0, 0);
+    mem_deinit();
+}
+
+int main(void) {
+    test_threads();
+    test_percpu();
+    test_remote();
+    test_contexts();
+    test_regions();
+    test_map_boundary();
+    test_map_tail();
+    test_trim();
+    test_prefault();
+    if (failures) {
+        fprintf(stderr, "mmtest: %d checks failed\n", failures);
+        exit(1);
+    }
+    printf("mmtest: all checks passed\n");
+    return 0;
+}
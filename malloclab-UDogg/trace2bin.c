@@ -0,0 +1,149 @@
+/*
+ * trace2bin - convert a .rep trace into the binary format of
+ * tracefmt.h, which mdriver maps instead of parsing.
+ *
+ * Usage: trace2bin <in.rep> [<out>]
+ *
+ * The output defaults to the input name with .rep replaced by .bin.
+ * Requests are converted one at a time, so traces of any length need
+ * only a buffer's worth of memory.  The huge sizes go before the ops,
+ * so the input is read twice: once for them and once for the ops.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024     /* max string size */
+#define BATCH   4096     /* ops written at a time */
+
+static void die(const char *file, const char *msg) {
+    fprintf(stderr, "trace2bin: %s: %s\n", file, msg);
+    exit(1);
+}
+
+/*
+ * read_request - read the next request of in.  Returns false at the
+ *                end of the file.
+ */
+static bool read_request(FILE *in, const char *name, unsigned *type, long *index,
+                         unsigned long long *size) {
+    char word[MAXLINE];
+
+    if (fscanf(in, "%s", word) != 1)
+        return false;
+    *size = 0;
+    switch (word[0]) {
+        case 'a':
+        case 'r':
+            if (fscanf(in, "%ld %llu", index, size) != 2)
+                die(name, "bad request");
+            *type = word[0] == 'a' ? ALLOC : REALLOC;
+            break;
+        case 'f':
+            if (fscanf(in, "%ld", index) != 1)
+                die(name, "bad request");
+            *type = FREE;
+            break;
+        default:
+            die(name, "bogus request type");
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    static traceop_t batch[BATCH];
+    static uint64_t huge[BATCH];
+    char out_name[MAXLINE];
+    trace_header_t hdr;
+    FILE *in, *out;
+    long weight, num_ids, num_ops, index, max_index = -1;
+    unsigned long long data_bytes, size;
+    size_t n = 0, len;
+    long ops, num_huge = 0, start;
+    unsigned type;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <in.rep> [<out>]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 3) {
+        snprintf(out_name, sizeof(out_name), "%s", argv[2]);
+    } else {
+        len = strlen(argv[1]);
+        if (len > 4 && strcmp(argv[1] + len - 4, ".rep") == 0)
+            len -= 4;
+        snprintf(out_name, sizeof(out_name), "%.*s.bin", (int) len, argv[1]);
+    }
+
+    if ((in = fopen(argv[1], "r")) == NULL)
+        die(argv[1], "cannot open");
+    if (fscanf(in, "%ld %ld %ld %llu", &weight, &num_ids, &num_ops, &data_bytes) != 4)
+        die(argv[1], "bad header");
+    if (weight < 0 || weight > 3)
+        die(argv[1], "weight can only be in {0, 1, 2, 3}");
+    if (num_ids < 0 || num_ids > (long) TRACE_MAX_IDS || num_ops < 0 || num_ops > INT_MAX)
+        die(argv[1], "too many ids or ops");
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.weight = weight;
+    hdr.num_ids = num_ids;
+    hdr.num_ops = num_ops;
+    hdr.data_bytes = data_bytes;
+    if ((out = fopen(out_name, "wb")) == NULL)
+        die(out_name, "cannot create");
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        die(out_name, "write failed");
+
+    /* First pass: the huge sizes, in the order the ops use them */
+    start = ftell(in);
+    for (ops = 0; ops < num_ops && read_request(in, argv[1], &type, &index, &size); ops++) {
+        if (size < TRACE_HUGE)
+            continue;
+        huge[n] = size;
+        if (++num_huge > INT_MAX)
+            die(argv[1], "too many huge sizes");
+        if (++n == BATCH) {
+            if (fwrite(huge, sizeof(uint64_t), n, out) != n)
+                die(out_name, "write failed");
+            n = 0;
+        }
+    }
+    if (fwrite(huge, sizeof(uint64_t), n, out) != n)
+        die(out_name, "write failed");
+    hdr.num_huge = num_huge;
+
+    /* Second pass: the ops */
+    fseek(in, start, SEEK_SET);
+    n = 0;
+    num_huge = 0;
+    for (ops = 0; ops < num_ops && read_request(in, argv[1], &type, &index, &size); ops++) {
+        if (index < (type == FREE ? -1 : 0) || index >= num_ids)
+            die(argv[1], "id out of range");
+        if (index > max_index)
+            max_index = index;
+        batch[n] = trace_op(type, index,
+                            size < TRACE_HUGE ? (uint32_t) size : TRACE_HUGE + num_huge++);
+        if (++n == BATCH) {
+            if (fwrite(batch, sizeof(traceop_t), n, out) != n)
+                die(out_name, "write failed");
+            n = 0;
+        }
+    }
+    if (fwrite(batch, sizeof(traceop_t), n, out) != n ||
+        fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        die(out_name, "write failed");
+    if (fclose(out) != 0)
+        die(out_name, "write failed");
+    fclose(in);
+    if (ops != num_ops || max_index != num_ids - 1) {
+        remove(out_name);
+        die(argv[1], "header does not match the requests");
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * trace2c - compile a .rep trace into straight-line C, for tracebench
+ *
+ * Usage: trace2c <in.rep> > trace_gen.c
+ *
+ * Each request becomes one call with its size as a constant, and the
+ * blocks live in a static array, so replaying the trace costs nothing
+ * but the calls themselves.  The output also keeps the requests as a
+ * traceop_t table and its huge sizes, so that tracebench can time
+ * mdriver's interpreter on exactly the same trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE   1024   /* max string size */
+#define PART_OPS  512    /* requests per generated function */
+
+static void die(const char *file, const char *msg) {
+    fprintf(stderr, "trace2c: %s: %s\n", file, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static const char *names[] = { "ALLOC", "FREE", "REALLOC" };
+    char type[MAXLINE];
+    traceop_t *ops;
+    unsigned long long *sizes;
+    FILE *in;
+    long weight, num_ids, num_ops, num_huge, index, i, parts;
+    unsigned long long data_bytes, size;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <in.rep> > trace_gen.c\n", argv[0]);
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+        die(argv[1], "cannot open");
+    if (fscanf(in, "%ld %ld %ld %llu", &weight, &num_ids, &num_ops, &data_bytes) != 4)
+        die(argv[1], "bad header");
+    if (num_ids < 1 || num_ids > (long) TRACE_MAX_IDS || num_ops < 0 || num_ops > INT_MAX)
+        die(argv[1], "bad id or op count");
+    if ((ops = malloc(num_ops * sizeof(traceop_t))) == NULL ||
+        (sizes = malloc(num_ops * sizeof(*sizes))) == NULL)
+        die(argv[1], "out of memory");
+
+    num_huge = 0;
+    for (i = 0; i < num_ops; i++) {
+        unsigned op_type;
+
+        if (fscanf(in, "%s", type) != 1)
+            die(argv[1], "fewer requests than the header promises");
+        size = 0;
+        switch (type[0]) {
+            case 'a':
+            case 'r':
+                if (fscanf(in, "%ld %llu", &index, &size) != 2 ||
+                    index < 0 || index >= num_ids)
+                    die(argv[1], "bad request");
+                op_type = type[0] == 'a' ? ALLOC : REALLOC;
+                break;
+            case 'f':
+                if (fscanf(in, "%ld", &index) != 1 || index < -1 || index >= num_ids)
+                    die(argv[1], "bad request");
+                op_type = FREE;
+                break;
+            default:
+                die(argv[1], "bogus request type");
+        }
+        /* The calls keep every size whole; only the table escapes */
+        sizes[i] = size;
+        ops[i] = trace_op(op_type, index,
+                          size < TRACE_HUGE ? (uint32_t) size : TRACE_HUGE + num_huge++);
+    }
+    fclose(in);
+
+    printf("/* Generated by trace2c from %s; do not edit. */\n", argv[1]);
+    printf("#include <stddef.h>\n#include <stdint.h>\n#include \"mm.h\"\n#include \"tracefmt.h\"\n\n");
+    printf("const char trace_name[] = \"%s\";\n", argv[1]);
+    printf("const int trace_num_ids = %ld;\n", num_ids);
+    printf("const int trace_num_ops = %ld;\n\n", num_ops);
+
+    /* One more entry in each table, so neither is ever empty */
+    printf("const uint64_t trace_huge[] = {\n");
+    for (i = 0; i < num_ops; i++)
+        if (sizes[i] >= TRACE_HUGE)
+            printf("    %lluull,\n", sizes[i]);
+    printf("    0\n};\n\n");
+
+    printf("const traceop_t trace_ops[] = {\n");
+    for (i = 0; i < num_ops; i++)
+        printf("    { %s | %uu << 2, %uu },\n", names[trace_op_type(ops[i])],
+               ops[i].word >> 2, ops[i].size);
+    printf("    { FREE | %uu << 2, 0 }\n};\n\n", TRACE_NULL_ID);
+
+    printf("static char *b[%ld];\n", num_ids);
+    parts = (num_ops + PART_OPS - 1) / PART_OPS;
+    for (i = 0; i < num_ops; i++) {
+        if (i % PART_OPS == 0)
+            printf("\n__attribute__((noinline)) static void part%ld(void)\n{\n", i / PART_OPS);
+        index = trace_op_index(ops[i]);
+        switch (trace_op_type(ops[i])) {
+            case ALLOC:
+                printf("    b[%ld] = mm_malloc(%lluul);\n", index, sizes[i]);
+                break;
+            case REALLOC:
+                printf("    b[%ld] = mm_realloc(b[%ld], %lluul);\n", index,
+                       index, sizes[i]);
+                break;
+            default:
+                if (index < 0)
+                    printf("    mm_free(NULL);\n");
+                else
+                    printf("    mm_free(b[%ld]);\n", index);
+                break;
+        }
+        if (i % PART_OPS == PART_OPS - 1 || i == num_ops - 1)
+            printf("}\n");
+    }
+
+    printf("\nvoid trace_replay(void)\n{\n");
+    for (i = 0; i < parts; i++)
+        printf("    part%ld();\n", i);
+    printf("}\n");
+    free(sizes);
+    free(ops);
+    return 0;
+}
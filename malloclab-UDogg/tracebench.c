@@ -0,0 +1,121 @@
+/*
+ * tracebench - times mm on one trace twice: through the interpreter
+ * loop that mdriver's eval_mm_speed uses, and as the straight-line
+ * code that trace2c compiled it into, which has no dispatch and no
+ * loads from a trace.
+ *
+ * Build with: make tracebench TRACE=traces/<name>.rep
+ *
+ * Both runs start each repetition from an empty heap and a fresh
+ * mm_init, as eval_mm_speed does, and take the best of fsec's samples.
+ *
+ * The compiled trace is not free either: each request is about 17
+ * bytes of code run once per repetition, so a trace of a few thousand
+ * requests already streams more code through the instruction cache
+ * than it holds, evicting the allocator's own.  Where the compiled
+ * run is the slower one, the interpreter's dispatch costs less than
+ * that, and eval_mm_speed's number is the closer to the allocator's.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "fcyc.h"
+#include "tracefmt.h"
+
+/* Defined by the trace2c output */
+extern const char trace_name[];
+extern const int trace_num_ids;
+extern const int trace_num_ops;
+extern const traceop_t trace_ops[];
+extern const uint64_t trace_huge[];
+extern void trace_replay(void);
+
+static char **blocks;   /* The interpreter's blocks, by id */
+
+static void app_error(const char *msg) {
+    fprintf(stderr, "tracebench: %s\n", msg);
+    exit(1);
+}
+
+static void start_run(void) {
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed");
+}
+
+/*
+ * run_interpreted - replay the trace as mdriver's replay_mm does
+ */
+static void run_interpreted(void *ptr) {
+    int i, index;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+
+    memset(blocks, 0, trace_num_ids * sizeof(*blocks));
+    start_run();
+    for (i = 0; i < trace_num_ops; i++)
+        switch (trace_op_type(trace_ops[i])) {
+
+            case ALLOC: /* mm_malloc */
+                index = trace_op_index(trace_ops[i]);
+                size = trace_op_size(trace_ops[i], trace_huge);
+                if ((p = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc error in replay_mm");
+                blocks[index] = p;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                index = trace_op_index(trace_ops[i]);
+                newsize = trace_op_size(trace_ops[i], trace_huge);
+                oldp = blocks[index];
+                if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
+                    app_error("mm_realloc error in replay_mm");
+                blocks[index] = newp;
+                break;
+
+            case FREE: /* mm_free */
+                index = trace_op_index(trace_ops[i]);
+                if (index < 0) {
+                    block = 0;
+                } else {
+                    block = blocks[index];
+                }
+                mm_free(block);
+                break;
+
+            default:
+                app_error("Nonexistent request type in replay_mm");
+        }
+}
+
+/*
+ * run_compiled - replay the trace as trace2c's straight-line code
+ */
+static void run_compiled(void *ptr) {
+    start_run();
+    trace_replay();
+}
+
+int main(void) {
+    double interp, compiled;
+
+    if ((blocks = calloc(trace_num_ids, sizeof(*blocks))) == NULL)
+        app_error("out of memory");
+    mem_init();
+
+    /* Warm up the heap pages, so the first timed run takes no faults */
+    run_interpreted(NULL);
+    interp = fsec(run_interpreted, NULL);
+    compiled = fsec(run_compiled, NULL);
+
+    printf("%-32s%10s%14s%14s%10s\n", "trace", "ops", "interp Kops",
+           "compiled Kops", "speedup");
+    printf("%-32s%10d%14.0f%14.0f%10.2f\n", trace_name, trace_num_ops,
+           trace_num_ops / interp * 0.001, trace_num_ops / compiled * 0.001,
+           interp / compiled);
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * tracefmt.h - the binary trace format
+ *
+ * A binary trace holds the same requests as a .rep file, laid out so
+ * that mdriver can mmap it and replay the ops where they lie: a
+ * trace_header_t, then num_huge 64-bit sizes, then num_ops traceop_t
+ * records, in the byte order of the machine that wrote it.  trace2bin
+ * converts a .rep file.
+ *
+ * Each op packs into 8 bytes: the type in the low 2 bits of word and
+ * the id in the other 30, then the size.  Sizes from TRACE_HUGE up do
+ * not fit; their size field is TRACE_HUGE plus an index into the huge
+ * sizes, which come before the ops so that a stream reader has them
+ * in hand before the first op that needs one.
+ */
+#ifndef TRACEFMT_H
+#define TRACEFMT_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC   "MMTRACE"  /* First bytes of a binary trace, NUL included */
+#define TRACE_VERSION 2          /* Bumped whenever the layout changes */
+
+#define TRACE_NULL_ID ((1u << 30) - 1) /* The id that stands for index -1 */
+#define TRACE_MAX_IDS TRACE_NULL_ID    /* Ids run from 0 to TRACE_MAX_IDS - 1 */
+#define TRACE_HUGE    0x80000000u      /* Sizes from here on are escaped */
+
+/* Request types */
+enum { ALLOC, FREE, REALLOC };
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    uint32_t word;    /* type of request, and id << 2 */
+    uint32_t size;    /* byte size of alloc/realloc request, or TRACE_HUGE + i */
+} traceop_t;
+
+/* The start of a binary trace; the huge sizes and the ops follow it */
+typedef struct {
+    char magic[8];        /* TRACE_MAGIC */
+    uint32_t version;     /* TRACE_VERSION */
+    uint32_t weight;      /* weight for this trace */
+    uint32_t num_ids;     /* number of alloc/realloc ids */
+    uint32_t num_ops;     /* number of distinct requests */
+    uint64_t data_bytes;  /* Peak number of data bytes allocated during trace */
+    uint32_t num_huge;    /* number of sizes escaped to the huge sizes */
+    uint32_t reserved;    /* zero */
+} trace_header_t;
+
+/* trace_op - pack a request whose size is size_field: the size itself
+   below TRACE_HUGE, otherwise TRACE_HUGE + its index in the huge sizes */
+static inline traceop_t trace_op(unsigned type, int32_t index, uint32_t size_field)
+{
+    traceop_t op;
+
+    op.word = type | (uint32_t)(index < 0 ? TRACE_NULL_ID : (uint32_t) index) << 2;
+    op.size = size_field;
+    return op;
+}
+
+static inline unsigned trace_op_type(traceop_t op)
+{
+    return op.word & 3;
+}
+
+/* trace_op_index - the id of op, or -1 for the null pointer */
+static inline int32_t trace_op_index(traceop_t op)
+{
+    uint32_t id = op.word >> 2;
+
+    return id == TRACE_NULL_ID ? -1 : (int32_t) id;
+}
+
+/* trace_op_size - the size of op, given the trace's huge sizes */
+static inline uint64_t trace_op_size(traceop_t op, const uint64_t *huge)
+{
+    return op.size < TRACE_HUGE ? op.size : huge[op.size - TRACE_HUGE];
+}
+
+#endif /* TRACEFMT_H */